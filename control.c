@@ -0,0 +1,413 @@
+/// \file control.c
+/// \brief Serves a Unix domain control socket through which a running
+/// firewall can be switched between modes, reloaded, queried and drained.
+///
+/// One thread polls the listening socket and every connected client, all
+/// of them non-blocking. Requests only touch the interface group through
+/// its atomic setters and getters (see iface.h), so answering them never
+/// takes a lock that the event loops wait on. A client that sends an
+/// overlong line, or does not read its replies, is disconnected.
+///
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+/// Most clients connected at once
+#define CONTROL_MAX_CLIENTS 16
+
+/// Longest request line, including the newline
+#define CONTROL_LINE_LEN    256
+
+/// Longest reply line
+#define CONTROL_REPLY_LEN   512
+
+/// The longest the control thread sleeps before checking for shutdown
+#define CONTROL_POLL_MS     100
+
+
+/// A connected control client and its partial request line
+typedef struct Client_S
+{
+   int fd;
+   char line[CONTROL_LINE_LEN];
+   size_t lineLen;
+} Client;
+
+
+/// The internal representation of a control server
+typedef struct Server_S
+{
+   char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+   IfaceGroup group;
+   int listenFd;
+   Client clients[CONTROL_MAX_CLIENTS];
+   pthread_t thread;
+   atomic_bool stop;
+} Server;
+
+
+/// Accepts connections and serves requests until the server is stopped.
+/// The return value and parameter must match those expected by pthread_create.
+/// @param args The server
+/// @return Always NULL
+static void* ControlThread(void* args);
+
+
+/// Accepts every pending connection
+/// @param server The server
+static void AcceptClients(Server* server);
+
+
+/// Reads from a client and handles each complete request line
+/// @param server The server
+/// @param client The client
+/// @return False if the client is to be disconnected
+static bool ReadClient(Server* server, Client* client);
+
+
+/// Handles a single request line
+/// @param server The server
+/// @param client The client that sent it
+/// @param line The request, without its newline
+/// @return False if the client is to be disconnected
+static bool HandleRequest(Server* server, Client* client, char* line);
+
+
+/// Sends one reply line to a client, adding the newline
+/// @param client The client
+/// @param format printf style format of the line
+/// @return False if the reply could not be sent in full
+static bool SendLine(Client* client, const char* format, ...);
+
+
+/// Closes a client connection
+/// @param client The client
+static void CloseClient(Client* client);
+
+
+/// Checks whether an existing socket file has nothing listening on it
+/// @param addr The socket address
+/// @return True if connecting to it is refused
+static bool StaleSocket(struct sockaddr_un* addr);
+
+
+/// Creates the control socket and starts the thread that serves it
+/// @param path The socket path
+/// @param group The interfaces that the commands act on
+/// @return The new control server, or NULL on failure
+ControlServer StartControlServer(char* path, IfaceGroup group)
+{
+   Server* server = calloc(1, sizeof(Server));
+   if(server == NULL) return NULL;
+
+   if(strlen(path) >= sizeof(server->path))
+   {
+      printf("ERROR, control socket path %s is too long\n", path);
+      free(server);
+      return NULL;
+   }
+   strcpy(server->path, path);
+   server->group = group;
+   atomic_init(&server->stop, false);
+   for(unsigned int i = 0; i < CONTROL_MAX_CLIENTS; i++) server->clients[i].fd = -1;
+
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   // Only replace a socket left behind by an earlier run, which refuses
+   // connections, never one that a running firewall is listening on
+   struct stat st;
+   if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+   {
+      if(!StaleSocket(&addr))
+      {
+         printf("ERROR, control socket %s is in use, pick another with -c\n", path);
+         free(server);
+         return NULL;
+      }
+      unlink(path);
+   }
+
+   server->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if(server->listenFd < 0 ||
+      bind(server->listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(server->listenFd, CONTROL_MAX_CLIENTS) != 0)
+   {
+      perror("ERROR, failed to create control socket:");
+      if(server->listenFd >= 0) close(server->listenFd);
+      free(server);
+      return NULL;
+   }
+
+   if(pthread_create(&server->thread, NULL, ControlThread, server) != 0)
+   {
+      printf("ERROR, failed to start control thread\n");
+      close(server->listenFd);
+      unlink(server->path);
+      free(server);
+      return NULL;
+   }
+
+   return server;
+}
+
+
+/// Stops the control thread, closes every connection and removes the
+/// socket file
+/// @param server The control server
+void StopControlServer(ControlServer server)
+{
+   Server* srv = server;
+   if(srv == NULL) return;
+
+   atomic_store(&srv->stop, true);
+   pthread_join(srv->thread, NULL);
+
+   for(unsigned int i = 0; i < CONTROL_MAX_CLIENTS; i++) CloseClient(&srv->clients[i]);
+   close(srv->listenFd);
+   unlink(srv->path);
+   free(srv);
+}
+
+
+/// Polls the listening socket and the clients, waking at least every
+/// CONTROL_POLL_MS to check whether the server has been stopped.
+/// @param args The server
+/// @return Always NULL
+static void* ControlThread(void* args)
+{
+   Server* server = args;
+   struct pollfd fds[CONTROL_MAX_CLIENTS + 1];
+   Client* polled[CONTROL_MAX_CLIENTS + 1];
+
+   while(!atomic_load_explicit(&server->stop, memory_order_relaxed))
+   {
+      nfds_t numFds = 0;
+      fds[numFds].fd = server->listenFd;
+      fds[numFds].events = POLLIN;
+      polled[numFds++] = NULL;
+
+      for(unsigned int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+      {
+         if(server->clients[i].fd < 0) continue;
+         fds[numFds].fd = server->clients[i].fd;
+         fds[numFds].events = POLLIN;
+         polled[numFds++] = &server->clients[i];
+      }
+
+      if(poll(fds, numFds, CONTROL_POLL_MS) <= 0) continue;
+
+      for(nfds_t i = 1; i < numFds; i++)
+      {
+         if(fds[i].revents != 0 && !ReadClient(server, polled[i])) CloseClient(polled[i]);
+      }
+
+      if(fds[0].revents & POLLIN) AcceptClients(server);
+   }
+
+   return NULL;
+}
+
+
+/// Accepts every pending connection. Connections beyond
+/// CONTROL_MAX_CLIENTS are told so and closed.
+/// @param server The server
+static void AcceptClients(Server* server)
+{
+   int fd;
+   while((fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+   {
+      Client* client = NULL;
+      for(unsigned int i = 0; client == NULL && i < CONTROL_MAX_CLIENTS; i++)
+      {
+         if(server->clients[i].fd < 0) client = &server->clients[i];
+      }
+
+      if(client == NULL)
+      {
+         Client rejected = { fd, "", 0 };
+         SendLine(&rejected, "ERROR too many control connections");
+         close(fd);
+         continue;
+      }
+
+      client->fd = fd;
+      client->lineLen = 0;
+   }
+}
+
+
+/// Reads whatever a client has sent and handles each complete line
+/// @param server The server
+/// @param client The client
+/// @return False if the client is to be disconnected
+static bool ReadClient(Server* server, Client* client)
+{
+   while(true)
+   {
+      ssize_t numRead = read(client->fd, client->line + client->lineLen,
+                             CONTROL_LINE_LEN - client->lineLen);
+      if(numRead == 0) return false;
+      if(numRead < 0) return errno == EAGAIN || errno == EINTR;
+
+      client->lineLen += (size_t)numRead;
+
+      char* newline;
+      while((newline = memchr(client->line, '\n', client->lineLen)) != NULL)
+      {
+         *newline = '\0';
+         if(newline > client->line && newline[-1] == '\r') newline[-1] = '\0';
+
+         bool keep = HandleRequest(server, client, client->line);
+
+         size_t used = (size_t)(newline + 1 - client->line);
+         memmove(client->line, newline + 1, client->lineLen - used);
+         client->lineLen -= used;
+         if(!keep) return false;
+      }
+
+      if(client->lineLen == CONTROL_LINE_LEN)
+      {
+         SendLine(client, "ERROR request too long");
+         return false;
+      }
+   }
+}
+
+
+/// Handles a single request line. Commands are not case sensitive.
+/// @param server The server
+/// @param client The client that sent it
+/// @param line The request, without its newline
+/// @return False if the client is to be disconnected
+static bool HandleRequest(Server* server, Client* client, char* line)
+{
+   static const char* modeNames[] = { "BLOCK", "ALLOW", "FILTER" };
+
+   char* save;
+   char* command = strtok_r(line, " \t", &save);
+   char* arg = strtok_r(NULL, " \t", &save);
+   if(command == NULL) return true;
+
+   if(strcasecmp(command, "MODE") == 0)
+   {
+      if(arg == NULL)
+         return SendLine(client, "OK %s", modeNames[GetFilterMode(server->group)]);
+
+      if(strcasecmp(arg, "BLOCK") == 0) SetFilterMode(server->group, MODE_BLOCK_ALL);
+      else if(strcasecmp(arg, "ALLOW") == 0) SetFilterMode(server->group, MODE_ALLOW_ALL);
+      else if(strcasecmp(arg, "FILTER") == 0) SetFilterMode(server->group, MODE_FILTER);
+      else return SendLine(client, "ERROR unknown mode %s", arg);
+
+      return SendLine(client, "OK");
+   }
+
+   if(strcasecmp(command, "RELOAD") == 0)
+   {
+      if(!ReloadIfaceGroup(server->group))
+         return SendLine(client, "ERROR reload failed, previous configuration kept");
+      return SendLine(client, "OK");
+   }
+
+   if(strcasecmp(command, "STATS") == 0)
+   {
+      for(unsigned int i = 0; i < NumInterfaces(server->group); i++)
+      {
+         IfaceStats stats;
+         GetIfaceStats(server->group, i, &stats);
+         if(!SendLine(client, "%u in=%llu allowed=%llu blocked=%llu dropped=%llu bytes_in=%llu "
+                      "bytes_out=%llu queued=%llu finished=%d", i,
+                      stats.pktsIn, stats.pktsAllowed, stats.pktsBlocked, stats.pktsDropped, stats.bytesIn,
+                      stats.bytesOut, stats.queuedBytes, stats.finished ? 1 : 0))
+            return false;
+      }
+      return SendLine(client, "OK");
+   }
+
+   if(strcasecmp(command, "DRAIN") == 0)
+   {
+      DrainIfaceGroup(server->group);
+      return SendLine(client, "OK");
+   }
+
+   if(strcasecmp(command, "HELP") == 0)
+   {
+      return SendLine(client, "MODE [BLOCK|ALLOW|FILTER]") &&
+             SendLine(client, "RELOAD") &&
+             SendLine(client, "STATS") &&
+             SendLine(client, "DRAIN") &&
+             SendLine(client, "OK");
+   }
+
+   return SendLine(client, "ERROR unknown command %s", command);
+}
+
+
+/// Sends one reply line to a client. Replies are small, so a client that
+/// cannot take a whole line at once is not reading them and is dropped.
+/// @param client The client
+/// @param format printf style format of the line
+/// @return False if the reply could not be sent in full
+static bool SendLine(Client* client, const char* format, ...)
+{
+   char reply[CONTROL_REPLY_LEN];
+
+   va_list args;
+   va_start(args, format);
+   int len = vsnprintf(reply, sizeof(reply) - 1, format, args);
+   va_end(args);
+
+   if(len < 0) return false;
+   if((size_t)len > sizeof(reply) - 2) len = (int)sizeof(reply) - 2;
+   reply[len++] = '\n';
+
+   ssize_t numSent;
+   do
+      numSent = send(client->fd, reply, (size_t)len, MSG_NOSIGNAL);
+   while(numSent < 0 && errno == EINTR);
+
+   return numSent == len;
+}
+
+
+/// Closes a client connection
+/// @param client The client
+static void CloseClient(Client* client)
+{
+   if(client->fd >= 0) close(client->fd);
+   client->fd = -1;
+   client->lineLen = 0;
+}
+
+
+/// Checks whether an existing socket file has nothing listening on it.
+/// Any outcome other than a refused connection, including a successful
+/// one, is treated as the socket being in use.
+/// @param addr The socket address
+/// @return True if connecting to it is refused
+static bool StaleSocket(struct sockaddr_un* addr)
+{
+   int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if(fd < 0) return false;
+
+   bool stale = connect(fd, (struct sockaddr*)addr, sizeof(*addr)) != 0 && errno == ECONNREFUSED;
+   close(fd);
+   return stale;
+}
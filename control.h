@@ -0,0 +1,52 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+/// \file control.h
+/// \brief Serves a Unix domain control socket through which a running
+/// firewall can be switched between modes, reloaded, queried and drained.
+///
+/// The protocol is line based text. Each request is one line and each
+/// reply ends with a line that starts with "OK" or "ERROR":
+///
+///    MODE [BLOCK|ALLOW|FILTER]   sets the mode, or reports it without an argument
+///    RELOAD                      rereads every interface's configuration file
+///    STATS                       one "<i> in=.. allowed=.. blocked=.. dropped=..
+///                                bytes_in=.. bytes_out=.. queued=.. finished=.."
+///                                line per interface
+///    DRAIN                       stops reading input, flushes the queues and exits;
+///                                packets queued for an output with no reader
+///                                are dropped and counted
+///    HELP                        lists the commands
+///
+/// Requests are handled on a thread of their own, so a slow client never
+/// holds up the event loops.
+///
+
+#include <stdbool.h>
+
+#include "iface.h"
+
+/// Name of the control socket when none is given
+#define CONTROL_DEFAULT_PATH "FirewallControl"
+
+
+/// The type used by the client to store/use a control server
+typedef void* ControlServer;
+
+
+/// Creates the control socket and starts the thread that serves it. An
+/// existing socket at the same path is replaced only if nothing is
+/// listening on it, so a second firewall in the same directory fails
+/// instead of taking over the first one's socket. Any other kind of file
+/// is left alone.
+/// @param path The socket path
+/// @param group The interfaces that the commands act on
+/// @return The new control server, or NULL on failure
+ControlServer StartControlServer(char* path, IfaceGroup group);
+
+
+/// Stops the control thread, closes every connection and removes the
+/// socket file
+/// @param server The control server
+void StopControlServer(ControlServer server);
+
+#endif
@@ -192,9 +192,11 @@ bool ConfigureFilter(IpPktFilter filter, char* filename)
       else
       {
 	  printf("ERROR, invalid line in config file\n");
+	  fclose(pFile);
 	  return false; 
       }
   }
+   fclose(pFile);
 	
    if( fltCfg->localIpAddr == 0 )
    {
@@ -252,6 +254,28 @@ bool FilterPacket(IpPktFilter filter, unsigned char* pkt)
 }
 
 
+/// Determines if an IP packet is long enough for FilterPacket() to
+/// examine. Every packet needs a full 20 byte IP header. ICMP packets also
+/// need the type byte that follows the header, and TCP packets the source
+/// and destination ports. The header length field is used when it is
+/// larger than 20 bytes.
+/// @param pkt The IP packet that is to be checked
+/// @param length The length of the packet in bytes
+/// @return True if FilterPacket() can be called on the packet
+bool PacketIsFilterable(unsigned char* pkt, unsigned int length)
+{
+   if(length < 20) return false;
+
+   unsigned int headerLen = (pkt[0] & 0x0F) * 4;
+   if(headerLen < 20) headerLen = 20;
+
+   unsigned int protocol = pkt[9];
+   if(protocol == IP_PROTOCOL_ICMP) return length >= headerLen + 1;
+   if(protocol == IP_PROTOCOL_TCP) return length >= headerLen + 4;
+   return true;
+}
+
+
 /// Checks if an IP address is listed as blocked by the supplied filter.
 /// @param fltCfg The filter configuration to use
 /// @param addr The IP address that is to be checked
@@ -50,5 +50,14 @@ bool ConfigureFilter(IpPktFilter filter, char* filename);
 /// @return True if the packet is allowed, False if it should be blocked
 bool FilterPacket(IpPktFilter filter, unsigned char* pkt);
 
+
+/// Determines if an IP packet is long enough for FilterPacket() to
+/// examine: the IP header, plus the ICMP type of an ICMP packet or the
+/// TCP ports of a TCP packet
+/// @param pkt The IP packet that is to be checked
+/// @param length The length of the packet in bytes
+/// @return True if FilterPacket() can be called on the packet
+bool PacketIsFilterable(unsigned char* pkt, unsigned int length);
+
 #endif
 
@@ -1,6 +1,6 @@
 /// \file firewall.c
-/// \brief Reads IP packets from a named pipe, examines each packet,
-/// and writes allowed packets to an output named pipe.
+/// \brief Reads IP packets from one or more named pipes, examines each
+/// packet, and writes allowed packets to the matching output named pipes.
 /// Author: Chris Dickens (RIT CS)
 ///
 ///
@@ -15,167 +15,158 @@
 ///
 /// Modified/finished by Justin Gottshall - jmg8766@cs.rit.edu
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
 
+#include "control.h"
 #include "filter.h"
+#include "iface.h"
+#include "replay.h"
 
 
-/// Type used to control the mode of the firewall
-typedef enum FilterMode_e
+/// Settings taken from the command line
+typedef struct FirewallOptions_S
 {
-   MODE_BLOCK_ALL,
-   MODE_ALLOW_ALL,
-   MODE_FILTER
-} FilterMode;
-
-
-/// The input named pipe, "ToFirewall"
-static FILE* InPipe = NULL;
-
+   /// The interface specs, "configFile[:inPipe:outPipe]"
+   char** specs;
+   unsigned int numSpecs;
 
-/// The output named pipe, "FromFirewall"
-static FILE* OutPipe = NULL;
+   /// Number of event loop threads serving the interfaces
+   unsigned int numLoops;
 
+   /// Path of the control socket
+   char* controlPath;
 
-/// Controls the mode of the firewall
-volatile FilterMode Mode = MODE_FILTER;
-
-
-/// A flag to report the state of the filte thread
-volatile bool threadIsDead = false;
-
-/// The main function that performs the actual packet read, filter, and write.
-/// The return value and parameter must match those expected by pthread_create.
-/// @param args A pointer to a filter
-/// @return Always NULL
-static void* FilterThread(void* args);
+   /// Offline replay settings, used when replay.inFile is set
+   ReplayOptions replay;
+} FirewallOptions;
 
 
 /// Displays the menu of commands that the user can choose from.
 static void DisplayMenu(void);
 
 
-/// Opens the input and output named files.
-/// @return True if successful
-static bool OpenPipes(void);
+/// Waits for the next menu selection, or for the interfaces to finish
+/// @param group The interface group
+/// @param selection Receives the selected character
+/// @return False once the interfaces have finished
+static bool ReadSelection(IfaceGroup group, char* selection);
+
 
+/// Parses the interface specs and the options that follow them.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param opts Receives the settings
+/// @return True if the arguments are valid
+static bool ParseOptions(int argc, char* argv[], FirewallOptions* opts);
 
-/// Reads a packet from the input name pipe.
-/// @param buf Destination buffer to write the packet into
-/// @param bufLength The length of the supplied destination buffer
-/// @param len The length of the packet
-/// @return True if successful
-//static bool ReadPacket(unsigned char* buf, int bufLength, int* len);
+
+/// Filters a capture file offline using the configuration file of the
+/// only interface spec.
+/// @param opts The command line settings
+/// @return EXIT_SUCCESS or EXIT_FAILURE
+static int RunReplay(FirewallOptions* opts);
 
 
-/// The main function. Creates a filter, configures it, launches the
-/// filtering thread, handles user input, and cleans up resources when
-/// exiting.  The intention is to run this program with a command line
-/// argument specifying the configuration file to use.
+/// The main function. Creates and configures the interfaces, launches
+/// the event loop threads, handles user input, and cleans up resources
+/// when exiting.  The intention is to run this program with a command
+/// line argument specifying the configuration file to use, optionally
+/// followed by more "configFile:inPipe:outPipe" interfaces (see iface.h).
+/// The firewall can also be controlled through a socket, see control.h.
+/// When a capture file is given with -r the packets are filtered offline
+/// instead, see replay.h.
 /// @param argc Number of command line arguments
 /// @param argv Command line arguments
 /// @return EXIT_SUCCESS or EXIT_FAILURE
 int main(int argc, char* argv[])
 {   
    // Argument Validation
-   if(argc <= 1)
+   FirewallOptions opts;
+   if(argc <= 1 || !ParseOptions(argc, argv, &opts))
    { 
-      printf("usage: firewall configFileName\n");
+      printf("usage: firewall configFileName[:inPipe:outPipe] ... [-l loops] [-c controlSocket]\n");
+      printf("       firewall configFileName "
+             "-r captureFile [-o outFile] [-b bitmapFile] [-t threads]\n");
       return EXIT_FAILURE;
    }
 
-   // Create and configure the filter
-   IpPktFilter filter = CreateFilter(); 
-   if(!ConfigureFilter(filter, argv[1])) return EXIT_FAILURE;
+   // Offline replay of a capture file, no pipes or menu involved
+   if(opts.replay.inFile != NULL) return RunReplay(&opts);
 
-   // Starts a second thread to filter packets
-   pthread_t filterThread;
-   pthread_create(&filterThread, NULL, FilterThread, filter);
-   
+   // Create and configure the interfaces
+   IfaceGroup group = CreateIfaceGroup(opts.specs, opts.numSpecs);
+   if(group == NULL) return EXIT_FAILURE;
 
-   // Responds to user input
+   // Starts the threads that filter packets
+   if(!StartIfaceGroup(group, opts.numLoops))
+   {
+      DestroyIfaceGroup(group);
+      return EXIT_FAILURE;
+   }
+
+   // Accepts commands from other processes
+   ControlServer control = StartControlServer(opts.controlPath, group);
+   if(control == NULL)
+   {
+      DestroyIfaceGroup(group);
+      return EXIT_FAILURE;
+   }
+
+   // Responds to user input. stdin is read unbuffered so that input
+   // already waiting is never hidden from poll() in ReadSelection().
+   setvbuf(stdin, NULL, _IONBF, 0);
    DisplayMenu();
-   while(true) 
+   char userInput;
+   while(ReadSelection(group, &userInput))
    {
-      if(threadIsDead)
-      {
-	 pthread_cancel(filterThread);
-         DestroyFilter(filter);
-         return EXIT_SUCCESS;
-      }      
-
-      unsigned char userInput;
-      while(scanf(" %c", &userInput) != 1);
-      
       switch((unsigned int)userInput)
       {
          case 48 : // Representing 0
-	    pthread_cancel(filterThread);
-	    DestroyFilter(filter);
+            StopControlServer(control);
+            DestroyIfaceGroup(group);
             return EXIT_SUCCESS;
 
 	 case 49 : // Representing 1
-            Mode = MODE_BLOCK_ALL;
+            SetFilterMode(group, MODE_BLOCK_ALL);
 	    break;
 
 	 case 50 : // Representing 2
-            Mode = MODE_ALLOW_ALL;
+            SetFilterMode(group, MODE_ALLOW_ALL);
 	    break;
 
 	 case 51 : // Representing 3
-	    Mode = MODE_FILTER;
+	    SetFilterMode(group, MODE_FILTER);
 	    break;
 
+         case 52 : // Representing 4
+            PrintIfaceStats(group);
+            break;
+
+         case 53 : // Representing 5
+            if(!ReloadIfaceGroup(group))
+               printf("ERROR, reload failed, previous configuration kept\n");
+            break;
+
 	 default : // Unrecognized input is ignored
 	    break;
       }
 
       printf("> ");
+      fflush(stdout);
    }
-}
-
 
-/// Runs as a thread and handles each packet. It is responsible
-/// for reading each packet in its entirety from the input pipe,
-/// filtering it, and then writing it to the output pipe. The
-/// single void* parameter matches what is expected by pthread.
-/// @param args An IpPktFilter
-/// @return Always NULL
-static void* FilterThread(void* args)
-{
-   if(OpenPipes() == false) 
-   {
-      threadIsDead = true;
-      return NULL;
-   }
-   
-   // loop until EOF
-   while(!feof(InPipe))
-   {
-      // Read in the size of the packet
-      int packetLength; fread(&packetLength, sizeof(int), 1, InPipe);
-      
-      // Read the packet
-      unsigned char packet[packetLength]; fread(packet, sizeof(char), packetLength, InPipe); 
-
-      // If mode is ALLOW_ALL or mode is FILTER and this packet is allowed by the filter
-      if( Mode == MODE_ALLOW_ALL || (Mode == MODE_FILTER && FilterPacket(args, packet)) )
-      {
-         // Write the size
-	 fwrite(&packetLength, sizeof(int), 1, OutPipe);
-
-	 // Write the packet
-	 fwrite(packet, sizeof(char), packetLength, OutPipe);
-	 fflush(OutPipe);
-      }
-   }
-
-   return NULL;
+   StopControlServer(control);
+   DestroyIfaceGroup(group);
+   return EXIT_SUCCESS;
 }
 
 
@@ -186,29 +177,135 @@ static void DisplayMenu(void)
    printf("\n1. Block All\n");
    printf("2. Allow All\n");
    printf("3. Filter\n");
+   printf("4. Statistics\n");
+   printf("5. Reload\n");
    printf("0. Exit\n");
    printf("> ");
+   fflush(stdout);
+}
+
+
+/// Waits for the next non-blank character on stdin, checking every
+/// 100 ms whether the interfaces have finished (for example after a
+/// DRAIN on the control socket). stdin must be unbuffered so that input
+/// already waiting is never hidden from poll(). Once stdin ends, the
+/// firewall keeps filtering until the inputs end.
+/// @param group The interface group
+/// @param selection Receives the selected character
+/// @return False once the interfaces have finished
+static bool ReadSelection(IfaceGroup group, char* selection)
+{
+   static bool inputDone = false;
+   struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+
+   while(!IfaceGroupDone(group))
+   {
+      if(inputDone || poll(&pfd, 1, 100) <= 0)
+      {
+         if(inputDone)
+         {
+            struct timespec delay = { 0, 100000000 };
+            nanosleep(&delay, NULL);
+         }
+         continue;
+      }
+
+      int c = getchar();
+      if(c == EOF)
+         inputDone = true;
+      else if(c != ' ' && c != '\t' && c != '\n' && c != '\r')
+      {
+         *selection = (char)c;
+         return true;
+      }
+   }
+
+   return false;
 }
 
 
-/// Open the input and output named pipes that are used for reading
-/// and writing packets.
-/// @return True if successful
-static bool OpenPipes(void)
+/// Collects the interface specs, which run up to the first argument that
+/// starts with '-', then reads the -l, -c, -r, -o, -b and -t options. The
+/// replay output options are only valid with -r, while -l and -c are only
+/// valid without it, and replay takes a single plain configuration file.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param opts Receives the settings
+/// @return True if the arguments are valid
+static bool ParseOptions(int argc, char* argv[], FirewallOptions* opts)
 {
-   InPipe = fopen("ToFirewall", "rb");
-   if(InPipe == NULL)
+   memset(opts, 0, sizeof(FirewallOptions));
+   ReplayOptions* replay = &opts->replay;
+
+   int first = 1;
+   while(first < argc && argv[first][0] != '-') first++;
+   opts->specs = &argv[1];
+   opts->numSpecs = (unsigned int)(first - 1);
+   opts->numLoops = 1;
+   opts->controlPath = CONTROL_DEFAULT_PATH;
+   if(opts->numSpecs == 0) return false;
+
+   // -l and -c only apply to the pipes, so they are refused with -r
+   bool hasLiveOptions = false;
+   int opt;
+   optind = first;
+   while((opt = getopt(argc, argv, "l:c:r:o:b:t:")) != -1)
    {
-      perror("ERROR, failed to open pipe ToFirewall:");
-      return false;
+      switch(opt)
+      {
+         case 'l' :
+            if(sscanf(optarg, "%u", &opts->numLoops) != 1 || opts->numLoops == 0) return false;
+            hasLiveOptions = true;
+            break;
+
+         case 'c' :
+            opts->controlPath = optarg;
+            hasLiveOptions = true;
+            break;
+
+         case 'r' :
+            replay->inFile = optarg;
+            break;
+
+         case 'o' :
+            replay->outFile = optarg;
+            break;
+
+         case 'b' :
+            replay->bitmapFile = optarg;
+            break;
+
+         case 't' :
+            if(sscanf(optarg, "%u", &replay->numThreads) != 1) return false;
+            break;
+
+         default :
+            return false;
+      }
    }
 
-   OutPipe = fopen("FromFirewall", "wb");
-   if(OutPipe == NULL)
+   if(optind != argc) return false;
+
+   bool hasOutputs = replay->outFile != NULL || replay->bitmapFile != NULL || replay->numThreads != 0;
+   if(replay->inFile == NULL) return !hasOutputs;
+
+   return !hasLiveOptions && opts->numSpecs == 1 && strchr(opts->specs[0], ':') == NULL;
+}
+
+
+/// Creates and configures a filter and replays the capture through it
+/// @param opts The command line settings
+/// @return EXIT_SUCCESS or EXIT_FAILURE
+static int RunReplay(FirewallOptions* opts)
+{
+   IpPktFilter filter = CreateFilter(); 
+   if(!ConfigureFilter(filter, opts->specs[0]))
    {
-      perror("ERROR, failed to open pipe FromFirewall:");
-      return false;
+      DestroyFilter(filter);
+      return EXIT_FAILURE;
    }
 
-   return true;
+   bool success = ReplayCapture(filter, &opts->replay);
+   DestroyFilter(filter);
+   return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
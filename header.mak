@@ -1,3 +1,3 @@
-CFLAGS =        -ggdb -std=c99 -Wall -Wextra -pedantic -Werror -O2
+CFLAGS =        -ggdb -std=c11 -Wall -Wextra -pedantic -Werror -O2
 CLIBFLAGS =     -lm -lpthread 
 
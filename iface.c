@@ -0,0 +1,1038 @@
+/// \file iface.c
+/// \brief Serves several ingress/egress named pipe pairs, each with its
+/// own filter configuration, from one or more epoll event loops.
+///
+/// All pipes are non-blocking. Each event loop owns a subset of the
+/// interfaces and is the only thread that touches their buffers. Input is
+/// read into a per-interface buffer and split into [int len][bytes]
+/// frames; allowed frames are appended to the interface's output queue
+/// and written whenever the output pipe can take them. An interface only
+/// reads its input while its queue has room for everything one read can
+/// produce, so packets are never dropped and a full queue only pauses
+/// that interface. Output pipes are opened once a reader appears, and
+/// reopened if the reader goes away.
+///
+/// State shared with other threads uses C11 atomics. The event loops read
+/// the mode with a relaxed load per packet and publish their counters once
+/// per batch with relaxed stores, so the control plane never takes a lock
+/// the data path waits on. A reload swaps in new filters and frees the old
+/// ones only after every loop has started a new iteration, and so can no
+/// longer be using them.
+///
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "iface.h"
+
+/// Largest frame accepted on an input pipe, including the length field
+#define IFACE_MAX_FRAME     (65535 + sizeof(int))
+
+/// Size of the per-interface input buffer
+#define IFACE_IN_BUF_LEN    ((64 << 10) + IFACE_MAX_FRAME)
+
+/// Size of the per-interface output queue
+#define IFACE_QUEUE_LEN     (4 << 20)
+
+/// How often to retry opening an output pipe that has no reader, and
+/// the longest an event loop sleeps before checking for shutdown
+#define IFACE_RETRY_MS      100
+
+#define IFACE_MAX_EVENTS    64
+#define IFACE_NAME_LEN      256
+
+
+/// A single ingress/egress pipe pair and its filter
+typedef struct Iface_S
+{
+   char configFile[IFACE_NAME_LEN];
+   char inName[IFACE_NAME_LEN];
+   char outName[IFACE_NAME_LEN];
+   _Atomic(IpPktFilter) filter;
+   unsigned int id;
+   int epollFd;
+
+   int inFd;
+   unsigned char* inBuf;
+   size_t inLen;
+   bool inWatched;
+   bool inDone;
+
+   int outFd;
+   unsigned char* queue;
+   size_t queueHead;
+   size_t queueLen;
+   size_t frameLeft;
+   bool outWatched;
+   unsigned long long nextConnectMs;
+
+   // Written only by the owning event loop, read by any thread
+   atomic_bool finished;
+   atomic_ullong pktsIn;
+   atomic_ullong pktsAllowed;
+   atomic_ullong pktsBlocked;
+   atomic_ullong pktsDropped;
+   atomic_ullong bytesIn;
+   atomic_ullong bytesOut;
+   atomic_ullong queuedBytes;
+
+   // Only used by the main thread
+   IfaceStats lastStats;
+} Iface;
+
+
+struct Group_S;
+
+
+/// An event loop thread and the epoll instance it waits on
+typedef struct IoLoop_S
+{
+   struct Group_S* group;
+   unsigned int id;
+
+   // Total number of loops, fixed before any loop is started
+   unsigned int stride;
+   int epollFd;
+   pthread_t thread;
+   atomic_ulong epoch;
+   atomic_bool done;
+} IoLoop;
+
+
+/// The state of an interface group
+typedef struct Group_S
+{
+   Iface* ifaces;
+   unsigned int numIfaces;
+   IoLoop* loops;
+   unsigned int numLoops;
+   atomic_int mode;
+   atomic_bool stop;
+   atomic_bool draining;
+   pthread_mutex_t reloadLock;
+   struct timespec lastStatsTime;
+} Group;
+
+
+/// Fills in the pipe names and configuration file of an interface
+/// @param spec The spec string "configFile[:inPipe:outPipe]"
+/// @param iface The interface to fill in
+/// @return True if the spec is valid
+static bool ParseSpec(char* spec, Iface* iface);
+
+
+/// Runs as a thread and services the interfaces owned by one loop.
+/// The return value and parameter must match those expected by pthread_create.
+/// @param args An IoLoop
+/// @return Always NULL
+static void* IoLoopThread(void* args);
+
+
+/// Reads from an interface's input pipe and filters the complete frames
+/// @param group The interface group
+/// @param iface The interface
+/// @param events The epoll events reported for the input pipe
+static void ReadInput(Group* group, Iface* iface, unsigned int events);
+
+
+/// Filters the complete frames in the input buffer and queues the
+/// allowed ones
+/// @param group The interface group
+/// @param iface The interface
+static void ProcessFrames(Group* group, Iface* iface);
+
+
+/// Writes as much of the output queue as the output pipe will take
+/// @param iface The interface
+static void FlushQueue(Iface* iface);
+
+
+/// Removes bytes that have been written from the front of the queue
+/// @param iface The interface
+/// @param numBytes Number of bytes written
+static void AdvanceQueue(Iface* iface, size_t numBytes);
+
+
+/// Tries to open the output pipe, which only succeeds once it has a reader
+/// @param iface The interface
+static void ConnectOutput(Iface* iface);
+
+
+/// Discards everything queued for output, counting it as dropped
+/// @param iface The interface
+static void DropQueue(Iface* iface);
+
+
+/// Closes the input pipe and discards any partial frame
+/// @param iface The interface
+static void CloseInput(Iface* iface);
+
+
+/// Closes the output pipe and drops the rest of a partly written frame
+/// @param iface The interface
+static void CloseOutput(Iface* iface);
+
+
+/// Watches the input pipe only while the queue has room for a full input buffer
+/// @param iface The interface
+static void UpdateInputWatch(Iface* iface);
+
+
+/// Watches the output pipe only while there is something queued to write
+/// @param iface The interface
+static void UpdateOutputWatch(Iface* iface);
+
+
+/// Adds to a counter that only the calling event loop writes
+/// @param counter The counter
+/// @param value The amount to add
+static void AddCounter(atomic_ullong* counter, unsigned long long value);
+
+
+/// Waits until every running event loop has started a new iteration
+/// @param group The interface group
+static void WaitForLoops(Group* group);
+
+
+/// Pins an event loop to one of the CPUs the process may run on
+/// @param loop The event loop, which must be running
+/// @param allowed The CPUs the process may run on
+static void PinLoop(IoLoop* loop, cpu_set_t* allowed);
+
+
+/// Returns the current monotonic time in milliseconds
+static unsigned long long NowMs(void);
+
+
+/// Creates the interfaces, configures a filter for each and opens the
+/// input pipes without blocking.
+/// @param specs The interface spec strings
+/// @param numSpecs Number of interfaces
+/// @return The new interface group, or NULL on failure
+IfaceGroup CreateIfaceGroup(char* specs[], unsigned int numSpecs)
+{
+   Group* group = calloc(1, sizeof(Group));
+   if(group == NULL) return NULL;
+
+   group->ifaces = calloc(numSpecs, sizeof(Iface));
+   if(group->ifaces == NULL)
+   {
+      free(group);
+      return NULL;
+   }
+
+   atomic_init(&group->mode, MODE_FILTER);
+   atomic_init(&group->stop, false);
+   atomic_init(&group->draining, false);
+   pthread_mutex_init(&group->reloadLock, NULL);
+
+   for(unsigned int i = 0; i < numSpecs; i++)
+   {
+      Iface* iface = &group->ifaces[i];
+      iface->id = i;
+      iface->inFd = -1;
+      iface->outFd = -1;
+      iface->epollFd = -1;
+      atomic_init(&iface->filter, NULL);
+      atomic_init(&iface->finished, false);
+      atomic_init(&iface->pktsIn, 0);
+      atomic_init(&iface->pktsAllowed, 0);
+      atomic_init(&iface->pktsBlocked, 0);
+      atomic_init(&iface->pktsDropped, 0);
+      atomic_init(&iface->bytesIn, 0);
+      atomic_init(&iface->bytesOut, 0);
+      atomic_init(&iface->queuedBytes, 0);
+      group->numIfaces++;
+
+      if(numSpecs > 1 && i > 0)
+      {
+         snprintf(iface->inName, IFACE_NAME_LEN, "ToFirewall%u", i);
+         snprintf(iface->outName, IFACE_NAME_LEN, "FromFirewall%u", i);
+      }
+      else
+      {
+         strcpy(iface->inName, "ToFirewall");
+         strcpy(iface->outName, "FromFirewall");
+      }
+
+      if(!ParseSpec(specs[i], iface))
+      {
+         printf("ERROR, invalid interface \"%s\", expected configFile[:inPipe:outPipe]\n", specs[i]);
+         DestroyIfaceGroup(group);
+         return NULL;
+      }
+
+      IpPktFilter filter = CreateFilter();
+      atomic_store(&iface->filter, filter);
+      if(!ConfigureFilter(filter, iface->configFile))
+      {
+         DestroyIfaceGroup(group);
+         return NULL;
+      }
+
+      iface->inBuf = malloc(IFACE_IN_BUF_LEN);
+      iface->queue = malloc(IFACE_QUEUE_LEN);
+      if(iface->inBuf == NULL || iface->queue == NULL)
+      {
+         printf("ERROR, out of memory creating interface %u\n", i);
+         DestroyIfaceGroup(group);
+         return NULL;
+      }
+
+      iface->inFd = open(iface->inName, O_RDONLY | O_NONBLOCK);
+      if(iface->inFd < 0)
+      {
+         printf("ERROR, failed to open pipe %s: %s\n", iface->inName, strerror(errno));
+         DestroyIfaceGroup(group);
+         return NULL;
+      }
+   }
+
+   return group;
+}
+
+
+/// Stops the event loops, closes every pipe and destroys the filters
+/// @param group The interface group
+void DestroyIfaceGroup(IfaceGroup group)
+{
+   Group* grp = group;
+
+   StopIfaceGroup(grp);
+
+   for(unsigned int i = 0; i < grp->numIfaces; i++)
+   {
+      Iface* iface = &grp->ifaces[i];
+      if(iface->inFd >= 0) close(iface->inFd);
+      if(iface->outFd >= 0) close(iface->outFd);
+      IpPktFilter filter = atomic_load(&iface->filter);
+      if(filter != NULL) DestroyFilter(filter);
+      free(iface->inBuf);
+      free(iface->queue);
+   }
+
+   pthread_mutex_destroy(&grp->reloadLock);
+   free(grp->ifaces);
+   free(grp);
+}
+
+
+/// Creates one epoll instance per loop, hands out the interfaces
+/// round-robin and starts the loop threads
+/// @param group The interface group
+/// @param numLoops Number of event loop threads
+/// @return True if successful
+bool StartIfaceGroup(IfaceGroup group, unsigned int numLoops)
+{
+   Group* grp = group;
+
+   // A reader closing an output pipe must show up as EPIPE, not a signal
+   signal(SIGPIPE, SIG_IGN);
+
+   if(numLoops == 0) numLoops = 1;
+   if(numLoops > grp->numIfaces) numLoops = grp->numIfaces;
+
+   grp->loops = calloc(numLoops, sizeof(IoLoop));
+   if(grp->loops == NULL) return false;
+   atomic_store(&grp->stop, false);
+
+   for(unsigned int i = 0; i < numLoops; i++)
+   {
+      grp->loops[i].group = grp;
+      grp->loops[i].id = i;
+      grp->loops[i].stride = numLoops;
+      atomic_init(&grp->loops[i].epoch, 0);
+      atomic_init(&grp->loops[i].done, false);
+      grp->loops[i].epollFd = epoll_create1(0);
+      if(grp->loops[i].epollFd < 0)
+      {
+         perror("ERROR, failed to create epoll instance:");
+         for(unsigned int j = 0; j < i; j++) close(grp->loops[j].epollFd);
+         free(grp->loops);
+         grp->loops = NULL;
+         return false;
+      }
+   }
+
+   for(unsigned int i = 0; i < grp->numIfaces; i++)
+   {
+      grp->ifaces[i].epollFd = grp->loops[i % numLoops].epollFd;
+      UpdateInputWatch(&grp->ifaces[i]);
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &grp->lastStatsTime);
+
+   // Loops are spread over the CPUs this process is allowed to use, which
+   // taskset or a cpuset may have narrowed
+   cpu_set_t allowed;
+   bool pin = numLoops > 1;
+   if(pin && sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+   {
+      perror("WARNING, failed to read the CPU affinity, event loops are not pinned:");
+      pin = false;
+   }
+   if(pin && CPU_COUNT(&allowed) < 2) pin = false;
+
+   for(unsigned int i = 0; i < numLoops; i++)
+   {
+      if(pthread_create(&grp->loops[i].thread, NULL, IoLoopThread, &grp->loops[i]) != 0)
+      {
+         // Only the loops that were started are joined
+         printf("ERROR, failed to start event loop thread\n");
+         for(unsigned int j = i; j < numLoops; j++) close(grp->loops[j].epollFd);
+         StopIfaceGroup(grp);
+         return false;
+      }
+      grp->numLoops++;
+
+      if(pin) PinLoop(&grp->loops[i], &allowed);
+   }
+
+   return true;
+}
+
+
+/// Asks the event loops to exit and waits for them. A loop notices within
+/// IFACE_RETRY_MS even when its pipes are idle.
+/// @param group The interface group
+void StopIfaceGroup(IfaceGroup group)
+{
+   Group* grp = group;
+   if(grp->loops == NULL) return;
+
+   atomic_store(&grp->stop, true);
+   for(unsigned int i = 0; i < grp->numLoops; i++)
+   {
+      pthread_join(grp->loops[i].thread, NULL);
+      close(grp->loops[i].epollFd);
+   }
+
+   for(unsigned int i = 0; i < grp->numIfaces; i++)
+   {
+      grp->ifaces[i].epollFd = -1;
+      grp->ifaces[i].inWatched = false;
+      grp->ifaces[i].outWatched = false;
+   }
+
+   free(grp->loops);
+   grp->loops = NULL;
+   grp->numLoops = 0;
+}
+
+
+/// Reports whether every event loop has run out of work
+/// @param group The interface group
+/// @return True once all event loops have finished
+bool IfaceGroupDone(IfaceGroup group)
+{
+   Group* grp = group;
+   if(grp->loops == NULL) return false;
+
+   for(unsigned int i = 0; i < grp->numLoops; i++)
+   {
+      if(!atomic_load_explicit(&grp->loops[i].done, memory_order_acquire)) return false;
+   }
+
+   return true;
+}
+
+
+/// Sets the mode used by the event loops for the packets that follow
+/// @param group The interface group
+/// @param mode The new mode
+void SetFilterMode(IfaceGroup group, FilterMode mode)
+{
+   atomic_store_explicit(&((Group*)group)->mode, mode, memory_order_relaxed);
+}
+
+
+/// Returns the current mode
+/// @param group The interface group
+/// @return The mode
+FilterMode GetFilterMode(IfaceGroup group)
+{
+   return (FilterMode)atomic_load_explicit(&((Group*)group)->mode, memory_order_relaxed);
+}
+
+
+/// Configures a new filter for every interface from its configuration
+/// file. Only if they all succeed are they swapped in; the old filters are
+/// destroyed once no event loop can still be using them.
+/// @param group The interface group
+/// @return True if successful
+bool ReloadIfaceGroup(IfaceGroup group)
+{
+   Group* grp = group;
+   bool success = true;
+
+   pthread_mutex_lock(&grp->reloadLock);
+
+   IpPktFilter* filters = calloc(grp->numIfaces, sizeof(IpPktFilter));
+   if(filters == NULL) success = false;
+
+   for(unsigned int i = 0; success && i < grp->numIfaces; i++)
+   {
+      filters[i] = CreateFilter();
+      if(!ConfigureFilter(filters[i], grp->ifaces[i].configFile)) success = false;
+   }
+
+   if(success)
+   {
+      for(unsigned int i = 0; i < grp->numIfaces; i++)
+         filters[i] = atomic_exchange(&grp->ifaces[i].filter, filters[i]);
+
+      WaitForLoops(grp);
+   }
+
+   // Either the old filters, or the new ones that were not used
+   for(unsigned int i = 0; filters != NULL && i < grp->numIfaces; i++)
+   {
+      if(filters[i] != NULL) DestroyFilter(filters[i]);
+   }
+   free(filters);
+
+   pthread_mutex_unlock(&grp->reloadLock);
+   return success;
+}
+
+
+/// Closes every input pipe. Each interface finishes once its queued
+/// packets have been written, after which the event loops exit. Packets
+/// queued for an output that has no reader are dropped.
+/// @param group The interface group
+void DrainIfaceGroup(IfaceGroup group)
+{
+   atomic_store(&((Group*)group)->draining, true);
+}
+
+
+/// Returns the number of interfaces in a group
+/// @param group The interface group
+/// @return The number of interfaces
+unsigned int NumInterfaces(IfaceGroup group)
+{
+   return ((Group*)group)->numIfaces;
+}
+
+
+/// Copies the counters of an interface
+/// @param group The interface group
+/// @param iface The interface number
+/// @param stats Receives the counters
+void GetIfaceStats(IfaceGroup group, unsigned int iface, IfaceStats* stats)
+{
+   Iface* ifc = &((Group*)group)->ifaces[iface];
+
+   stats->pktsIn = atomic_load_explicit(&ifc->pktsIn, memory_order_relaxed);
+   stats->pktsAllowed = atomic_load_explicit(&ifc->pktsAllowed, memory_order_relaxed);
+   stats->pktsBlocked = atomic_load_explicit(&ifc->pktsBlocked, memory_order_relaxed);
+   stats->pktsDropped = atomic_load_explicit(&ifc->pktsDropped, memory_order_relaxed);
+   stats->bytesIn = atomic_load_explicit(&ifc->bytesIn, memory_order_relaxed);
+   stats->bytesOut = atomic_load_explicit(&ifc->bytesOut, memory_order_relaxed);
+   stats->queuedBytes = atomic_load_explicit(&ifc->queuedBytes, memory_order_relaxed);
+   stats->finished = atomic_load_explicit(&ifc->finished, memory_order_relaxed);
+}
+
+
+/// Prints the counters of every interface along with the packet and byte
+/// rates since the previous call
+/// @param group The interface group
+void PrintIfaceStats(IfaceGroup group)
+{
+   Group* grp = group;
+
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   double seconds = (double)(now.tv_sec - grp->lastStatsTime.tv_sec) +
+                    (double)(now.tv_nsec - grp->lastStatsTime.tv_nsec) / 1e9;
+   if(seconds <= 0) seconds = 1e-9;
+   grp->lastStatsTime = now;
+
+   for(unsigned int i = 0; i < grp->numIfaces; i++)
+   {
+      Iface* iface = &grp->ifaces[i];
+      IfaceStats stats;
+      GetIfaceStats(grp, i, &stats);
+
+      printf("\n%u. %s -> %s (%s)%s\n", i, iface->inName, iface->outName, iface->configFile,
+             stats.finished ? " finished" : "");
+      printf("   packets: %llu in, %llu allowed, %llu blocked, %llu dropped\n",
+             stats.pktsIn, stats.pktsAllowed, stats.pktsBlocked, stats.pktsDropped);
+      printf("   bytes: %llu in, %llu out, %llu queued\n",
+             stats.bytesIn, stats.bytesOut, stats.queuedBytes);
+      printf("   rate: %.0f packets/sec in, %.0f packets/sec allowed, %.1f KB/s out\n",
+             (stats.pktsIn - iface->lastStats.pktsIn) / seconds,
+             (stats.pktsAllowed - iface->lastStats.pktsAllowed) / seconds,
+             (stats.bytesOut - iface->lastStats.bytesOut) / seconds / 1e3);
+
+      iface->lastStats = stats;
+   }
+}
+
+
+/// Fills in the pipe names and configuration file of an interface. The
+/// pipe names are optional, but must be given together.
+/// @param spec The spec string "configFile[:inPipe:outPipe]"
+/// @param iface The interface to fill in
+/// @return True if the spec is valid
+static bool ParseSpec(char* spec, Iface* iface)
+{
+   char* inName = strchr(spec, ':');
+   size_t configLen = inName != NULL ? (size_t)(inName - spec) : strlen(spec);
+   if(configLen == 0 || configLen >= IFACE_NAME_LEN) return false;
+
+   memcpy(iface->configFile, spec, configLen);
+   iface->configFile[configLen] = '\0';
+   if(inName == NULL) return true;
+
+   inName++;
+   char* outName = strchr(inName, ':');
+   if(outName == NULL) return false;
+
+   size_t inLen = (size_t)(outName - inName);
+   outName++;
+   size_t outLen = strlen(outName);
+   if(inLen == 0 || inLen >= IFACE_NAME_LEN || outLen == 0 || outLen >= IFACE_NAME_LEN)
+      return false;
+
+   memcpy(iface->inName, inName, inLen);
+   iface->inName[inLen] = '\0';
+   strcpy(iface->outName, outName);
+   return true;
+}
+
+
+/// Runs as a thread and services the interfaces owned by one loop until
+/// they have all finished or the group is stopped. The epoll data of each
+/// pipe holds the interface number shifted left by one, with the low bit
+/// set for output pipes.
+/// @param args An IoLoop
+/// @return Always NULL
+static void* IoLoopThread(void* args)
+{
+   IoLoop* loop = args;
+   Group* group = loop->group;
+   struct epoll_event events[IFACE_MAX_EVENTS];
+
+   while(!atomic_load_explicit(&group->stop, memory_order_relaxed))
+   {
+      // Tells a reload that nothing from the last iteration is still in use.
+      // This and the filter swap are sequentially consistent, so a loop
+      // that increments after a reload has seen the epoch also sees the
+      // new filters.
+      atomic_fetch_add(&loop->epoch, 1);
+
+      bool active = false;
+      bool draining = atomic_load_explicit(&group->draining, memory_order_relaxed);
+      unsigned long long now = NowMs();
+      for(unsigned int i = loop->id; i < group->numIfaces; i += loop->stride)
+      {
+         Iface* iface = &group->ifaces[i];
+         if(atomic_load_explicit(&iface->finished, memory_order_relaxed)) continue;
+
+         active = true;
+         if(draining && !iface->inDone) CloseInput(iface);
+         if(iface->outFd < 0 && now >= iface->nextConnectMs)
+         {
+            iface->nextConnectMs = now + IFACE_RETRY_MS;
+            ConnectOutput(iface);
+         }
+      }
+      if(!active) break;
+
+      int numEvents = epoll_wait(loop->epollFd, events, IFACE_MAX_EVENTS, IFACE_RETRY_MS);
+      if(numEvents < 0)
+      {
+         if(errno == EINTR) continue;
+         perror("ERROR, epoll_wait failed:");
+         break;
+      }
+
+      for(int e = 0; e < numEvents; e++)
+      {
+         Iface* iface = &group->ifaces[events[e].data.u64 >> 1];
+         if(events[e].data.u64 & 1)
+            FlushQueue(iface);
+         else
+            ReadInput(group, iface, events[e].events);
+      }
+
+      // An interface is done once its input has ended and its queue is
+      // empty. While draining, a queue that has no reader to go to is
+      // dropped instead of waiting for one.
+      for(unsigned int i = loop->id; i < group->numIfaces; i += loop->stride)
+      {
+         Iface* iface = &group->ifaces[i];
+         if(atomic_load_explicit(&iface->finished, memory_order_relaxed) || !iface->inDone) continue;
+
+         if(draining && iface->outFd < 0) DropQueue(iface);
+         if(iface->queueLen == 0 && (iface->outFd >= 0 || draining))
+         {
+            CloseOutput(iface);
+            atomic_store_explicit(&iface->finished, true, memory_order_relaxed);
+         }
+      }
+   }
+
+   atomic_store_explicit(&loop->done, true, memory_order_release);
+   return NULL;
+}
+
+
+/// Reads as much as fits in the input buffer, then filters and forwards
+/// the complete frames. A read of 0 bytes only means end of input once
+/// the writer has hung up; a FIFO that has never had a writer also reads
+/// as empty.
+/// @param group The interface group
+/// @param iface The interface
+/// @param events The epoll events reported for the input pipe
+static void ReadInput(Group* group, Iface* iface, unsigned int events)
+{
+   if(!iface->inWatched) return;
+
+   ssize_t numRead = read(iface->inFd, iface->inBuf + iface->inLen, IFACE_IN_BUF_LEN - iface->inLen);
+   if(numRead < 0)
+   {
+      if(errno == EAGAIN || errno == EINTR) return;
+      printf("ERROR, failed reading pipe %s: %s\n", iface->inName, strerror(errno));
+      CloseInput(iface);
+      return;
+   }
+
+   if(numRead == 0)
+   {
+      if(events & (EPOLLHUP | EPOLLERR)) CloseInput(iface);
+      return;
+   }
+
+   iface->inLen += (size_t)numRead;
+   AddCounter(&iface->bytesIn, (unsigned long long)numRead);
+
+   ProcessFrames(group, iface);
+   FlushQueue(iface);
+}
+
+
+/// Filters each complete frame in the input buffer according to the
+/// firewall mode, appends the allowed frames to the output queue and
+/// moves any partial frame to the front of the buffer. The queue always
+/// has room, since input is only read while it can hold a full buffer.
+/// @param group The interface group
+/// @param iface The interface
+static void ProcessFrames(Group* group, Iface* iface)
+{
+   size_t pos = 0;
+   unsigned long long numAllowed = 0;
+   unsigned long long numBlocked = 0;
+   IpPktFilter filter = atomic_load(&iface->filter);
+
+   if(iface->queueHead + iface->queueLen + iface->inLen > IFACE_QUEUE_LEN)
+   {
+      memmove(iface->queue, iface->queue + iface->queueHead, iface->queueLen);
+      iface->queueHead = 0;
+   }
+
+   while(iface->inLen - pos >= sizeof(int))
+   {
+      int length;
+      memcpy(&length, iface->inBuf + pos, sizeof(int));
+      if(length < 0 || (size_t)length > IFACE_MAX_FRAME - sizeof(int))
+      {
+         printf("ERROR, invalid packet length %d on pipe %s\n", length, iface->inName);
+         CloseInput(iface);
+         break;
+      }
+
+      size_t frameLen = sizeof(int) + (size_t)length;
+      if(iface->inLen - pos < frameLen) break;
+
+      unsigned char* frame = iface->inBuf + pos;
+      FilterMode mode = (FilterMode)atomic_load_explicit(&group->mode, memory_order_relaxed);
+
+      // Frames too short to filter are blocked rather than read past
+      if(mode == MODE_ALLOW_ALL ||
+         (mode == MODE_FILTER && PacketIsFilterable(frame + sizeof(int), (unsigned int)length) &&
+          FilterPacket(filter, frame + sizeof(int))))
+      {
+         memcpy(iface->queue + iface->queueHead + iface->queueLen, frame, frameLen);
+         iface->queueLen += frameLen;
+         numAllowed++;
+      }
+      else
+         numBlocked++;
+
+      pos += frameLen;
+   }
+
+   AddCounter(&iface->pktsIn, numAllowed + numBlocked);
+   AddCounter(&iface->pktsAllowed, numAllowed);
+   AddCounter(&iface->pktsBlocked, numBlocked);
+
+   if(iface->inDone) return;
+
+   memmove(iface->inBuf, iface->inBuf + pos, iface->inLen - pos);
+   iface->inLen -= pos;
+}
+
+
+/// Writes as much of the output queue as the output pipe will take. If
+/// the reader has gone away the pipe is closed and the queue is kept
+/// until a new reader opens it.
+/// @param iface The interface
+static void FlushQueue(Iface* iface)
+{
+   while(iface->outFd >= 0 && iface->queueLen > 0)
+   {
+      ssize_t numWritten = write(iface->outFd, iface->queue + iface->queueHead, iface->queueLen);
+      if(numWritten < 0)
+      {
+         if(errno == EINTR) continue;
+         if(errno == EAGAIN) break;
+
+         if(errno != EPIPE)
+            printf("ERROR, failed writing pipe %s: %s\n", iface->outName, strerror(errno));
+         CloseOutput(iface);
+         break;
+      }
+
+      AdvanceQueue(iface, (size_t)numWritten);
+      AddCounter(&iface->bytesOut, (unsigned long long)numWritten);
+   }
+
+   if(iface->queueLen == 0) iface->queueHead = 0;
+   atomic_store_explicit(&iface->queuedBytes, iface->queueLen, memory_order_relaxed);
+
+   UpdateOutputWatch(iface);
+   UpdateInputWatch(iface);
+}
+
+
+/// Removes bytes that have been written from the front of the queue,
+/// keeping track of how much of the frame at the front is still to be
+/// written. Every queued frame was checked by ProcessFrames(), so its
+/// length field can be trusted.
+/// @param iface The interface
+/// @param numBytes Number of bytes written
+static void AdvanceQueue(Iface* iface, size_t numBytes)
+{
+   while(numBytes > 0)
+   {
+      if(iface->frameLeft == 0)
+      {
+         int length;
+         memcpy(&length, iface->queue + iface->queueHead, sizeof(int));
+         iface->frameLeft = sizeof(int) + (size_t)length;
+      }
+
+      size_t step = numBytes < iface->frameLeft ? numBytes : iface->frameLeft;
+      iface->queueHead += step;
+      iface->queueLen -= step;
+      iface->frameLeft -= step;
+      numBytes -= step;
+   }
+}
+
+
+/// Tries to open the output pipe without blocking. Opening a FIFO for
+/// writing fails with ENXIO until it has a reader, in which case the
+/// event loop tries again later. Running out of file descriptors is also
+/// retried, since it is usually temporary; any other failure ends the
+/// interface.
+/// @param iface The interface
+static void ConnectOutput(Iface* iface)
+{
+   iface->outFd = open(iface->outName, O_WRONLY | O_NONBLOCK);
+   if(iface->outFd >= 0)
+   {
+      FlushQueue(iface);
+      return;
+   }
+
+   // No reader yet, or out of file descriptors for the moment
+   if(errno == ENXIO || errno == EINTR || errno == EMFILE || errno == ENFILE) return;
+
+   printf("ERROR, failed to open pipe %s: %s\n", iface->outName, strerror(errno));
+   CloseInput(iface);
+   DropQueue(iface);
+   atomic_store_explicit(&iface->finished, true, memory_order_relaxed);
+}
+
+
+/// Discards everything queued for output. The queued frames, including
+/// the rest of one that was partly written, are counted as dropped.
+/// @param iface The interface
+static void DropQueue(Iface* iface)
+{
+   unsigned long long numDropped = 0;
+   size_t pos = iface->queueHead;
+   size_t end = iface->queueHead + iface->queueLen;
+
+   if(iface->frameLeft > 0)
+   {
+      pos += iface->frameLeft;
+      numDropped++;
+   }
+
+   while(pos < end)
+   {
+      int length;
+      memcpy(&length, iface->queue + pos, sizeof(int));
+      pos += sizeof(int) + (size_t)length;
+      numDropped++;
+   }
+
+   iface->queueHead = 0;
+   iface->queueLen = 0;
+   iface->frameLeft = 0;
+   atomic_store_explicit(&iface->queuedBytes, 0, memory_order_relaxed);
+   AddCounter(&iface->pktsDropped, numDropped);
+}
+
+
+/// Closes the input pipe and discards any partial frame
+/// @param iface The interface
+static void CloseInput(Iface* iface)
+{
+   iface->inDone = true;
+   UpdateInputWatch(iface);
+
+   if(iface->inFd >= 0) close(iface->inFd);
+   iface->inFd = -1;
+   iface->inLen = 0;
+}
+
+
+/// Closes the output pipe. A write may have stopped part way through a
+/// frame; the rest of it is dropped so that the next reader starts at a
+/// frame boundary instead of a desynchronised [len][bytes] stream.
+/// @param iface The interface
+static void CloseOutput(Iface* iface)
+{
+   if(iface->frameLeft > 0)
+   {
+      iface->queueHead += iface->frameLeft;
+      iface->queueLen -= iface->frameLeft;
+      iface->frameLeft = 0;
+      if(iface->queueLen == 0) iface->queueHead = 0;
+      atomic_store_explicit(&iface->queuedBytes, iface->queueLen, memory_order_relaxed);
+      AddCounter(&iface->pktsDropped, 1);
+   }
+
+   if(iface->outWatched)
+   {
+      epoll_ctl(iface->epollFd, EPOLL_CTL_DEL, iface->outFd, NULL);
+      iface->outWatched = false;
+   }
+
+   if(iface->outFd >= 0) close(iface->outFd);
+   iface->outFd = -1;
+}
+
+
+/// Adds the input pipe to, or removes it from, the loop's epoll set. It
+/// is removed rather than masked while paused, since a hung up pipe
+/// reports EPOLLHUP regardless of the requested events.
+/// @param iface The interface
+static void UpdateInputWatch(Iface* iface)
+{
+   bool want = !iface->inDone && iface->inFd >= 0 && iface->epollFd >= 0 &&
+               IFACE_QUEUE_LEN - iface->queueLen >= IFACE_IN_BUF_LEN;
+   if(want == iface->inWatched) return;
+
+   struct epoll_event event;
+   event.events = EPOLLIN;
+   event.data.u64 = (unsigned long long)iface->id << 1;
+
+   epoll_ctl(iface->epollFd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, iface->inFd, &event);
+   iface->inWatched = want;
+}
+
+
+/// Adds the output pipe to, or removes it from, the loop's epoll set
+/// @param iface The interface
+static void UpdateOutputWatch(Iface* iface)
+{
+   bool want = iface->outFd >= 0 && iface->queueLen > 0 && iface->epollFd >= 0;
+   if(want == iface->outWatched) return;
+
+   struct epoll_event event;
+   event.events = EPOLLOUT;
+   event.data.u64 = ((unsigned long long)iface->id << 1) | 1;
+
+   epoll_ctl(iface->epollFd, want ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, iface->outFd, &event);
+   iface->outWatched = want;
+}
+
+
+/// Adds to a counter that only the calling event loop writes. Since
+/// there is a single writer, a relaxed load and store is enough and
+/// avoids a locked read-modify-write.
+/// @param counter The counter
+/// @param value The amount to add
+static void AddCounter(atomic_ullong* counter, unsigned long long value)
+{
+   unsigned long long current = atomic_load_explicit(counter, memory_order_relaxed);
+   atomic_store_explicit(counter, current + value, memory_order_relaxed);
+}
+
+
+/// Waits until every event loop that is still running has started a new
+/// iteration. Loops wake at least every IFACE_RETRY_MS, so this returns
+/// promptly even when the pipes are idle.
+/// @param group The interface group
+static void WaitForLoops(Group* group)
+{
+   struct timespec delay = { 0, 1000000 };
+
+   for(unsigned int i = 0; i < group->numLoops; i++)
+   {
+      IoLoop* loop = &group->loops[i];
+      unsigned long epoch = atomic_load(&loop->epoch);
+
+      while(atomic_load(&loop->epoch) == epoch &&
+            !atomic_load_explicit(&loop->done, memory_order_acquire))
+         nanosleep(&delay, NULL);
+   }
+}
+
+
+/// Pins an event loop to one of the CPUs the process may run on. Loop i
+/// gets the (i mod n)th of the n allowed CPUs. A loop that cannot be
+/// pinned keeps running wherever the scheduler puts it.
+/// @param loop The event loop, which must be running
+/// @param allowed The CPUs the process may run on
+static void PinLoop(IoLoop* loop, cpu_set_t* allowed)
+{
+   unsigned int nth = loop->id % (unsigned int)CPU_COUNT(allowed);
+   int cpu = 0;
+   while(!CPU_ISSET(cpu, allowed) || nth-- > 0) cpu++;
+
+   cpu_set_t cpus;
+   CPU_ZERO(&cpus);
+   CPU_SET(cpu, &cpus);
+   int error = pthread_setaffinity_np(loop->thread, sizeof(cpu_set_t), &cpus);
+   if(error != 0)
+      printf("WARNING, failed to pin event loop %u to CPU %d: %s\n", loop->id, cpu, strerror(error));
+}
+
+
+/// Returns the current monotonic time in milliseconds
+/// @return Milliseconds since an arbitrary starting point
+static unsigned long long NowMs(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (unsigned long long)now.tv_sec * 1000 + (unsigned long long)now.tv_nsec / 1000000;
+}
@@ -0,0 +1,129 @@
+#ifndef __IFACE_H__
+#define __IFACE_H__
+/// \file iface.h
+/// \brief Serves several ingress/egress named pipe pairs, each with its
+/// own filter configuration, from one or more epoll event loops.
+///
+/// An interface is described by a spec string "configFile[:inPipe:outPipe]".
+/// Without pipe names, interface 0 uses ToFirewall/FromFirewall and
+/// interface i uses ToFirewall<i>/FromFirewall<i>. Each interface queues
+/// its allowed packets separately, and stops reading its input while its
+/// queue is full, so a slow consumer only holds up its own interface.
+///
+/// The mode, filters and counters may be read and changed from any thread
+/// while the event loops are running.
+///
+
+#include <stdbool.h>
+
+#include "filter.h"
+
+
+/// Type used to control the mode of the firewall
+typedef enum FilterMode_e
+{
+   MODE_BLOCK_ALL,
+   MODE_ALLOW_ALL,
+   MODE_FILTER
+} FilterMode;
+
+
+/// Packet and byte counters of a single interface
+typedef struct IfaceStats_S
+{
+   unsigned long long pktsIn;
+   unsigned long long pktsAllowed;
+   unsigned long long pktsBlocked;
+   unsigned long long pktsDropped;
+   unsigned long long bytesIn;
+   unsigned long long bytesOut;
+   unsigned long long queuedBytes;
+   bool finished;
+} IfaceStats;
+
+
+/// The type used by the client to store/use a set of interfaces
+typedef void* IfaceGroup;
+
+
+/// Creates and configures the interfaces and opens their input pipes.
+/// Output pipes are opened by the event loops once a reader appears.
+/// @param specs The interface spec strings
+/// @param numSpecs Number of interfaces
+/// @return The new interface group, or NULL on failure
+IfaceGroup CreateIfaceGroup(char* specs[], unsigned int numSpecs);
+
+
+/// Destroys an interface group, stopping its event loops first if they
+/// are still running, and frees all of its resources.
+/// @param group The interface group
+void DestroyIfaceGroup(IfaceGroup group);
+
+
+/// Starts the event loop threads. Interfaces are spread round-robin over
+/// the loops, and when there is more than one loop each is pinned to
+/// its own CPU.
+/// @param group The interface group
+/// @param numLoops Number of event loop threads
+/// @return True if successful
+bool StartIfaceGroup(IfaceGroup group, unsigned int numLoops);
+
+
+/// Stops the event loop threads and waits for them to exit
+/// @param group The interface group
+void StopIfaceGroup(IfaceGroup group);
+
+
+/// Reports whether every interface has reached the end of its input and
+/// written all of its queued packets
+/// @param group The interface group
+/// @return True once all event loops have finished
+bool IfaceGroupDone(IfaceGroup group);
+
+
+/// Sets the firewall mode. Groups start in MODE_FILTER, and the event
+/// loops apply a new mode from the next packet they process.
+/// @param group The interface group
+/// @param mode The new mode
+void SetFilterMode(IfaceGroup group, FilterMode mode);
+
+
+/// Returns the current firewall mode
+/// @param group The interface group
+/// @return The mode
+FilterMode GetFilterMode(IfaceGroup group);
+
+
+/// Rereads the configuration file of every interface. The new filters are
+/// only put in place if all of them load successfully.
+/// @param group The interface group
+/// @return True if successful
+bool ReloadIfaceGroup(IfaceGroup group);
+
+
+/// Stops reading from every input pipe and lets the queued packets be
+/// written out, after which IfaceGroupDone() reports true. Packets queued
+/// for an output that has no reader are dropped and counted instead.
+/// @param group The interface group
+void DrainIfaceGroup(IfaceGroup group);
+
+
+/// Returns the number of interfaces in a group
+/// @param group The interface group
+/// @return The number of interfaces
+unsigned int NumInterfaces(IfaceGroup group);
+
+
+/// Reads the counters of an interface
+/// @param group The interface group
+/// @param iface The interface number
+/// @param stats Receives the counters
+void GetIfaceStats(IfaceGroup group, unsigned int iface, IfaceStats* stats);
+
+
+/// Prints the counters of every interface, with the packet and byte
+/// rates since the previous call (or since the loops were started)
+/// @param group The interface group
+void PrintIfaceStats(IfaceGroup group);
+
+#endif
@@ -0,0 +1,773 @@
+/// \file pcap.c
+/// \brief Streaming readers and writers for pcap and pcapng capture files.
+///
+/// Regular files are mapped into memory and packets are returned as
+/// pointers into the mapping. Anything that cannot be mapped is read
+/// through a buffer that is refilled in place, so a packet view only
+/// stays valid until the next packet is requested. Both formats may be
+/// in either byte order; pcapng byte order is taken from each section
+/// header.
+///
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "filter.h"
+#include "pcap.h"
+
+#define PCAP_MAGIC_USEC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC      0xa1b23c4d
+#define PCAP_FILE_HDR_LEN    24
+#define PCAP_RECORD_HDR_LEN  16
+
+#define PCAPNG_BLOCK_SHB     0x0A0D0D0A
+#define PCAPNG_BLOCK_IDB     0x00000001
+#define PCAPNG_BLOCK_PB      0x00000002
+#define PCAPNG_BLOCK_SPB     0x00000003
+#define PCAPNG_BLOCK_EPB     0x00000006
+#define PCAPNG_BYTE_ORDER    0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL   9
+
+#define LINKTYPE_NULL        0
+#define LINKTYPE_ETHERNET    1
+#define LINKTYPE_RAW_OLD     12
+#define LINKTYPE_RAW         101
+#define LINKTYPE_LOOP        108
+#define LINKTYPE_LINUX_SLL   113
+#define LINKTYPE_IPV4        228
+#define LINKTYPE_LINUX_SLL2  276
+
+#define ETHERTYPE_IPV4       0x0800
+#define ETHERTYPE_VLAN       0x8100
+#define ETHERTYPE_QINQ       0x88a8
+#define ETHERTYPE_QINQ_OLD   0x9100
+
+/// Largest record or block the reader will accept
+#define PCAP_MAX_RECORD_LEN  (256u << 20)
+
+/// Initial size of the buffer used when the input cannot be mapped
+#define PCAP_STREAM_BUF_LEN  (1 << 20)
+
+/// Buffer size used for the output file
+#define PCAP_OUT_BUF_LEN     (1 << 20)
+
+
+/// A capture interface described by a pcapng Interface Description Block
+typedef struct PcapInterface_S
+{
+   unsigned int linkType;
+   unsigned long long unitsPerSec;
+} PcapInterface;
+
+
+/// The state of a capture reader
+typedef struct Reader_S
+{
+   PcapFormat format;
+   bool swap;
+   bool failed;
+   unsigned long long skipped;
+
+   // Memory-mapped input, or NULL when streaming from fd
+   unsigned char* map;
+   size_t mapSize;
+
+   // Streamed input, bytes [pos, bufLen) of buf are unread
+   int fd;
+   unsigned char* buf;
+   size_t bufLen;
+   size_t bufCap;
+
+   // Offset of the next unread byte in map or buf
+   size_t pos;
+
+   // pcap: link type and nanoseconds per timestamp fraction unit
+   unsigned int linkType;
+   unsigned int nsecPerUnit;
+
+   // pcapng: interfaces of the current section
+   PcapInterface* ifaces;
+   unsigned int numIfaces;
+   unsigned int maxIfaces;
+} Reader;
+
+
+/// The pcap file header
+typedef struct PcapFileHeader_S
+{
+   unsigned int magic;
+   unsigned short versionMajor;
+   unsigned short versionMinor;
+   int thisZone;
+   unsigned int sigFigs;
+   unsigned int snapLen;
+   unsigned int linkType;
+} PcapFileHeader;
+
+
+/// The pcapng Interface Description Block written for raw IPv4 packets
+/// with nanosecond timestamps
+typedef struct PcapngRawIdb_S
+{
+   unsigned int type;
+   unsigned int blockLen;
+   unsigned short linkType;
+   unsigned short reserved;
+   unsigned int snapLen;
+   unsigned short tsresolCode;
+   unsigned short tsresolLen;
+   unsigned char tsresol[4];
+   unsigned int endOfOpt;
+   unsigned int blockLenAgain;
+} PcapngRawIdb;
+
+
+/// The state of a capture writer
+typedef struct Writer_S
+{
+   FILE* pFile;
+   PcapFormat format;
+} Writer;
+
+
+/// Returns a pointer to the next len unread bytes, refilling the stream
+/// buffer if necessary. Does not consume the bytes.
+/// @param reader The capture reader
+/// @param len Number of bytes required
+/// @return The bytes, or NULL if the input ends first
+static unsigned char* Peek(Reader* reader, size_t len);
+
+
+/// Reads a 16 bit value in the byte order of the capture
+static unsigned int Read16(Reader* reader, unsigned char* p);
+
+
+/// Reads a 32 bit value in the byte order of the capture
+static unsigned int Read32(Reader* reader, unsigned char* p);
+
+
+/// Reads the next packet record of a pcap file
+/// @param reader The capture reader
+/// @param pkt Receives the packet
+/// @return True if a packet was found
+static bool NextPcapRecord(Reader* reader, PcapPacket* pkt);
+
+
+/// Reads blocks of a pcapng file until one holds a packet
+/// @param reader The capture reader
+/// @param pkt Receives the packet
+/// @return True if a packet was found
+static bool NextPcapngBlock(Reader* reader, PcapPacket* pkt);
+
+
+/// Records the interface described by a pcapng Interface Description Block
+/// @param reader The capture reader
+/// @param block The whole block
+/// @param blockLen Length of the block
+/// @return True if successful
+static bool AddInterface(Reader* reader, unsigned char* block, unsigned int blockLen);
+
+
+/// Skips the link-layer header of a frame and checks that what follows
+/// is an IPv4 packet long enough for FilterPacket() to examine
+/// @param linkType The link type of the frame
+/// @param frame The captured frame
+/// @param caplen Captured length of the frame
+/// @param pkt Receives the IPv4 packet view
+/// @return True if the frame holds a usable IPv4 packet
+static bool FindIpv4(unsigned int linkType, unsigned char* frame,
+                     unsigned int caplen, PcapPacket* pkt);
+
+
+/// Reads a big endian 16 bit value
+static unsigned int ReadBe16(unsigned char* p);
+
+
+/// Checks whether a file starts with a pcap or pcapng magic number
+/// @param filename The file to check
+/// @return True if the file is a pcap or pcapng capture
+bool IsPcapFile(char* filename)
+{
+   FILE* pFile = fopen(filename, "rb");
+   if(pFile == NULL) return false;
+
+   unsigned int magic = 0;
+   size_t numRead = fread(&magic, sizeof(unsigned int), 1, pFile);
+   fclose(pFile);
+   if(numRead != 1) return false;
+
+   unsigned int swapped = __builtin_bswap32(magic);
+   return magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+          swapped == PCAP_MAGIC_USEC || swapped == PCAP_MAGIC_NSEC ||
+          magic == PCAPNG_BLOCK_SHB;
+}
+
+
+/// Opens a capture, mapping it if it is a regular file, and reads the
+/// file header to find the format and byte order. For pcapng the section
+/// header is left for NextPcapngBlock() to read.
+/// @param filename The capture file, or "-" for stdin
+/// @return The new reader, or NULL on failure
+PcapReader OpenPcapReader(char* filename)
+{
+   Reader* reader = calloc(1, sizeof(Reader));
+   if(reader == NULL) return NULL;
+
+   reader->fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+   if(reader->fd < 0)
+   {
+      perror("ERROR, failed to open capture file:");
+      free(reader);
+      return NULL;
+   }
+
+   struct stat st;
+   if(fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+   {
+      reader->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+      if(reader->map == MAP_FAILED)
+         reader->map = NULL;
+      else
+      {
+         reader->mapSize = (size_t)st.st_size;
+         posix_madvise(reader->map, reader->mapSize, POSIX_MADV_SEQUENTIAL);
+      }
+   }
+
+   unsigned char* header = Peek(reader, sizeof(unsigned int));
+   unsigned int magic = 0;
+   if(header != NULL) memcpy(&magic, header, sizeof(unsigned int));
+   unsigned int swapped = __builtin_bswap32(magic);
+
+   if(magic == PCAPNG_BLOCK_SHB)
+   {
+      reader->format = PCAP_FORMAT_PCAPNG;
+      return reader;
+   }
+
+   if(magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+      swapped == PCAP_MAGIC_USEC || swapped == PCAP_MAGIC_NSEC)
+   {
+      reader->format = PCAP_FORMAT_PCAP;
+      reader->swap = swapped == PCAP_MAGIC_USEC || swapped == PCAP_MAGIC_NSEC;
+      reader->nsecPerUnit = (magic == PCAP_MAGIC_NSEC || swapped == PCAP_MAGIC_NSEC) ? 1 : 1000;
+
+      header = Peek(reader, PCAP_FILE_HDR_LEN);
+      if(header != NULL)
+      {
+         reader->linkType = Read32(reader, header + 20) & 0xFFFF;
+         reader->pos += PCAP_FILE_HDR_LEN;
+         return reader;
+      }
+   }
+
+   printf("ERROR, %s is not a pcap or pcapng file\n", filename);
+   ClosePcapReader(reader);
+   return NULL;
+}
+
+
+/// Finds the next IPv4 packet in the capture
+/// @param reader The capture reader
+/// @param pkt Receives a view of the packet
+/// @return True if a packet was found
+bool NextPcapPacket(PcapReader reader, PcapPacket* pkt)
+{
+   Reader* rdr = reader;
+   if(rdr->failed) return false;
+
+   if(rdr->format == PCAP_FORMAT_PCAP)
+      return NextPcapRecord(rdr, pkt);
+
+   return NextPcapngBlock(rdr, pkt);
+}
+
+
+/// Reports whether the reader stopped because of a malformed file
+/// @param reader The capture reader
+/// @return True if the capture was malformed or truncated
+bool PcapReaderFailed(PcapReader reader)
+{
+   return ((Reader*)reader)->failed;
+}
+
+
+/// Returns the number of frames skipped because they were not IPv4
+/// @param reader The capture reader
+/// @return The number of skipped frames
+unsigned long long PcapSkippedFrames(PcapReader reader)
+{
+   return ((Reader*)reader)->skipped;
+}
+
+
+/// Unmaps or closes the input and frees the reader
+/// @param reader The capture reader
+void ClosePcapReader(PcapReader reader)
+{
+   Reader* rdr = reader;
+
+   if(rdr->map != NULL) munmap(rdr->map, rdr->mapSize);
+   if(rdr->fd != STDIN_FILENO) close(rdr->fd);
+   free(rdr->buf);
+   free(rdr->ifaces);
+   free(rdr);
+}
+
+
+/// Creates a capture file and writes the file header. A pcapng file gets
+/// a section header and a single raw IPv4 interface with nanosecond
+/// timestamps; a pcap file uses microsecond timestamps, which every
+/// reader supports.
+/// @param filename The file to create, or "-" for stdout
+/// @param format The capture format to write
+/// @return The new writer, or NULL if the file could not be created
+PcapWriter OpenPcapWriter(char* filename, PcapFormat format)
+{
+   Writer* writer = malloc(sizeof(Writer));
+   if(writer == NULL) return NULL;
+
+   writer->format = format;
+   writer->pFile = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "wb");
+   if(writer->pFile == NULL)
+   {
+      perror("ERROR, failed to open capture output file:");
+      free(writer);
+      return NULL;
+   }
+   setvbuf(writer->pFile, NULL, _IOFBF, PCAP_OUT_BUF_LEN);
+
+   if(format == PCAP_FORMAT_PCAP)
+   {
+      PcapFileHeader header = { PCAP_MAGIC_USEC, 2, 4, 0, 0, 65535, LINKTYPE_RAW };
+      fwrite(&header, sizeof(header), 1, writer->pFile);
+   }
+   else
+   {
+      unsigned int shb[7] = { PCAPNG_BLOCK_SHB, 28, PCAPNG_BYTE_ORDER, 1, 0xFFFFFFFF, 0xFFFFFFFF, 28 };
+      unsigned short version[2] = { 1, 0 };
+      memcpy(&shb[3], version, sizeof(version));
+      PcapngRawIdb idb = { PCAPNG_BLOCK_IDB, sizeof(PcapngRawIdb), LINKTYPE_RAW, 0, 65535,
+                           PCAPNG_OPT_TSRESOL, 1, { 9, 0, 0, 0 }, 0, sizeof(PcapngRawIdb) };
+      fwrite(shb, sizeof(shb), 1, writer->pFile);
+      fwrite(&idb, sizeof(idb), 1, writer->pFile);
+   }
+
+   return writer;
+}
+
+
+/// Appends a raw IPv4 packet as a pcap record or a pcapng Enhanced
+/// Packet Block on interface 0
+/// @param writer The capture writer
+/// @param pkt The start of the IPv4 header
+/// @param length The length of the packet
+/// @param timestamp Capture time in nanoseconds since the epoch
+/// @return True if successful
+bool WritePcapPacket(PcapWriter writer, unsigned char* pkt, unsigned int length,
+                     unsigned long long timestamp)
+{
+   Writer* wrt = writer;
+
+   if(wrt->format == PCAP_FORMAT_PCAP)
+   {
+      unsigned int record[4] = { (unsigned int)(timestamp / 1000000000ULL),
+                                 (unsigned int)(timestamp % 1000000000ULL / 1000),
+                                 length, length };
+      fwrite(record, sizeof(record), 1, wrt->pFile);
+      fwrite(pkt, 1, length, wrt->pFile);
+   }
+   else
+   {
+      static const unsigned char pad[4] = { 0, 0, 0, 0 };
+      unsigned int padLen = (4 - length % 4) % 4;
+      unsigned int blockLen = 32 + length + padLen;
+      unsigned int epb[7] = { PCAPNG_BLOCK_EPB, blockLen, 0,
+                              (unsigned int)(timestamp >> 32), (unsigned int)timestamp,
+                              length, length };
+      fwrite(epb, sizeof(epb), 1, wrt->pFile);
+      fwrite(pkt, 1, length, wrt->pFile);
+      fwrite(pad, 1, padLen, wrt->pFile);
+      fwrite(&blockLen, sizeof(unsigned int), 1, wrt->pFile);
+   }
+
+   return !ferror(wrt->pFile);
+}
+
+
+/// Flushes and closes a capture writer
+/// @param writer The capture writer, which is destroyed
+/// @return True if successful
+bool ClosePcapWriter(PcapWriter writer)
+{
+   Writer* wrt = writer;
+
+   bool success = !ferror(wrt->pFile);
+   if(wrt->pFile == stdout)
+   {
+      if(fflush(stdout) != 0) success = false;
+   }
+   else if(fclose(wrt->pFile) != 0)
+      success = false;
+
+   free(wrt);
+   return success;
+}
+
+
+/// Returns a pointer to the next len unread bytes. When streaming, the
+/// unread bytes are moved to the front of the buffer and the buffer is
+/// grown and refilled until len bytes are available.
+/// @param reader The capture reader
+/// @param len Number of bytes required
+/// @return The bytes, or NULL if the input ends first
+static unsigned char* Peek(Reader* reader, size_t len)
+{
+   if(reader->map != NULL)
+      return reader->mapSize - reader->pos >= len ? reader->map + reader->pos : NULL;
+
+   if(reader->bufLen - reader->pos >= len)
+      return reader->buf + reader->pos;
+
+   if(reader->buf != NULL)
+      memmove(reader->buf, reader->buf + reader->pos, reader->bufLen - reader->pos);
+   reader->bufLen -= reader->pos;
+   reader->pos = 0;
+
+   if(reader->bufCap < len)
+   {
+      size_t cap = reader->bufCap > 0 ? reader->bufCap : PCAP_STREAM_BUF_LEN;
+      while(cap < len) cap *= 2;
+
+      unsigned char* pTemp = realloc(reader->buf, cap);
+      if(pTemp == NULL) return NULL;
+      reader->buf = pTemp;
+      reader->bufCap = cap;
+   }
+
+   while(reader->bufLen < len)
+   {
+      ssize_t numRead = read(reader->fd, reader->buf + reader->bufLen, reader->bufCap - reader->bufLen);
+      if(numRead < 0 && errno == EINTR) continue;
+      if(numRead <= 0) return NULL;
+      reader->bufLen += (size_t)numRead;
+   }
+
+   return reader->buf;
+}
+
+
+/// Reads a 16 bit value in the byte order of the capture
+/// @param reader The capture reader
+/// @param p The value's location
+/// @return The value in host byte order
+static unsigned int Read16(Reader* reader, unsigned char* p)
+{
+   unsigned short value;
+   memcpy(&value, p, sizeof(value));
+   return reader->swap ? __builtin_bswap16(value) : value;
+}
+
+
+/// Reads a 32 bit value in the byte order of the capture
+/// @param reader The capture reader
+/// @param p The value's location
+/// @return The value in host byte order
+static unsigned int Read32(Reader* reader, unsigned char* p)
+{
+   unsigned int value;
+   memcpy(&value, p, sizeof(value));
+   return reader->swap ? __builtin_bswap32(value) : value;
+}
+
+
+/// Reads pcap records until one holds an IPv4 packet
+/// @param reader The capture reader
+/// @param pkt Receives the packet
+/// @return True if a packet was found
+static bool NextPcapRecord(Reader* reader, PcapPacket* pkt)
+{
+   while(true)
+   {
+      unsigned char* record = Peek(reader, PCAP_RECORD_HDR_LEN);
+      if(record == NULL)
+      {
+         // A partial record header means the capture was cut short
+         size_t left = reader->map != NULL ? reader->mapSize - reader->pos : reader->bufLen - reader->pos;
+         reader->failed = left > 0;
+         return false;
+      }
+
+      unsigned int caplen = Read32(reader, record + 8);
+      if(caplen > PCAP_MAX_RECORD_LEN || (record = Peek(reader, PCAP_RECORD_HDR_LEN + caplen)) == NULL)
+      {
+         reader->failed = true;
+         return false;
+      }
+      reader->pos += PCAP_RECORD_HDR_LEN + caplen;
+
+      pkt->timestamp = Read32(reader, record) * 1000000000ULL +
+                       (unsigned long long)Read32(reader, record + 4) * reader->nsecPerUnit;
+      if(FindIpv4(reader->linkType, record + PCAP_RECORD_HDR_LEN, caplen, pkt))
+         return true;
+
+      reader->skipped++;
+   }
+}
+
+
+/// Reads pcapng blocks until one holds an IPv4 packet. Section headers
+/// set the byte order and reset the interface list, interface blocks are
+/// recorded, and packet blocks are decoded using their interface's link
+/// type and timestamp resolution. Other block types are skipped.
+/// @param reader The capture reader
+/// @param pkt Receives the packet
+/// @return True if a packet was found
+static bool NextPcapngBlock(Reader* reader, PcapPacket* pkt)
+{
+   while(true)
+   {
+      unsigned char* block = Peek(reader, 12);
+      if(block == NULL)
+      {
+         size_t left = reader->map != NULL ? reader->mapSize - reader->pos : reader->bufLen - reader->pos;
+         reader->failed = left > 0;
+         return false;
+      }
+
+      unsigned int type;
+      memcpy(&type, block, sizeof(unsigned int));
+      if(type == PCAPNG_BLOCK_SHB)
+      {
+         unsigned int byteOrder;
+         memcpy(&byteOrder, block + 8, sizeof(unsigned int));
+         if(byteOrder != PCAPNG_BYTE_ORDER && __builtin_bswap32(byteOrder) != PCAPNG_BYTE_ORDER)
+         {
+            reader->failed = true;
+            return false;
+         }
+         reader->swap = byteOrder != PCAPNG_BYTE_ORDER;
+         reader->numIfaces = 0;
+      }
+      type = Read32(reader, block);
+
+      unsigned int blockLen = Read32(reader, block + 4);
+      if(blockLen < 12 || blockLen % 4 != 0 || blockLen > PCAP_MAX_RECORD_LEN ||
+         (block = Peek(reader, blockLen)) == NULL)
+      {
+         reader->failed = true;
+         return false;
+      }
+      reader->pos += blockLen;
+
+      unsigned int ifaceId = 0;
+      unsigned long long units = 0;
+      unsigned int caplen = 0;
+      unsigned char* frame = NULL;
+
+      switch(type)
+      {
+         case PCAPNG_BLOCK_IDB :
+            if(!AddInterface(reader, block, blockLen)) return false;
+            continue;
+
+         case PCAPNG_BLOCK_EPB :
+            if(blockLen < 32) break;
+            ifaceId = Read32(reader, block + 8);
+            units = ((unsigned long long)Read32(reader, block + 12) << 32) | Read32(reader, block + 16);
+            caplen = Read32(reader, block + 20);
+            if(caplen <= blockLen - 32) frame = block + 28;
+            break;
+
+         case PCAPNG_BLOCK_PB :
+            if(blockLen < 32) break;
+            ifaceId = Read16(reader, block + 8);
+            units = ((unsigned long long)Read32(reader, block + 12) << 32) | Read32(reader, block + 16);
+            caplen = Read32(reader, block + 20);
+            if(caplen <= blockLen - 32) frame = block + 28;
+            break;
+
+         case PCAPNG_BLOCK_SPB :
+            if(blockLen < 16) break;
+            caplen = Read32(reader, block + 8);
+            if(caplen > blockLen - 16) caplen = blockLen - 16;
+            frame = block + 12;
+            break;
+
+         default :
+            continue;
+      }
+
+      if(frame == NULL || ifaceId >= reader->numIfaces)
+      {
+         reader->skipped++;
+         continue;
+      }
+
+      PcapInterface* iface = &reader->ifaces[ifaceId];
+      unsigned long long secs = units / iface->unitsPerSec;
+      unsigned long long frac = units % iface->unitsPerSec;
+      pkt->timestamp = secs * 1000000000ULL + (unsigned long long)((double)frac * 1e9 / iface->unitsPerSec);
+
+      if(FindIpv4(iface->linkType, frame, caplen, pkt))
+         return true;
+
+      reader->skipped++;
+   }
+}
+
+
+/// Records the interface described by a pcapng Interface Description
+/// Block. The if_tsresol option sets the timestamp resolution, which is
+/// otherwise microseconds.
+/// @param reader The capture reader
+/// @param block The whole block
+/// @param blockLen Length of the block
+/// @return True if successful
+static bool AddInterface(Reader* reader, unsigned char* block, unsigned int blockLen)
+{
+   if(blockLen < 20)
+   {
+      reader->failed = true;
+      return false;
+   }
+
+   if(reader->numIfaces == reader->maxIfaces)
+   {
+      unsigned int max = reader->maxIfaces > 0 ? reader->maxIfaces * 2 : 4;
+      PcapInterface* pTemp = realloc(reader->ifaces, sizeof(PcapInterface) * max);
+      if(pTemp == NULL)
+      {
+         reader->failed = true;
+         return false;
+      }
+      reader->ifaces = pTemp;
+      reader->maxIfaces = max;
+   }
+
+   PcapInterface* iface = &reader->ifaces[reader->numIfaces++];
+   iface->linkType = Read16(reader, block + 8);
+   iface->unitsPerSec = 1000000;
+
+   // Walk the options between the fixed fields and the trailing length
+   unsigned int offset = 16;
+   while(offset + 4 <= blockLen - 4)
+   {
+      unsigned int code = Read16(reader, block + offset);
+      unsigned int optLen = Read16(reader, block + offset + 2);
+      if(code == 0 || offset + 4 + optLen > blockLen - 4) break;
+
+      if(code == PCAPNG_OPT_TSRESOL && optLen >= 1)
+      {
+         unsigned int resol = block[offset + 4];
+         unsigned int exponent = resol & 0x7F;
+         unsigned long long base = (resol & 0x80) ? 2 : 10;
+         unsigned long long unitsPerSec = 1;
+         for(unsigned int i = 0; i < exponent && unitsPerSec < (1ULL << 60); i++)
+            unitsPerSec *= base;
+         iface->unitsPerSec = unitsPerSec;
+      }
+
+      offset += 4 + (optLen + 3) / 4 * 4;
+   }
+
+   return true;
+}
+
+
+/// Skips the link-layer header of a frame. Ethernet frames may carry
+/// any number of VLAN tags. The IPv4 packet must be long enough for the
+/// header fields FilterPacket() reads, and its length is trimmed to the
+/// IPv4 total length so link-layer padding is dropped.
+/// @param linkType The link type of the frame
+/// @param frame The captured frame
+/// @param caplen Captured length of the frame
+/// @param pkt Receives the IPv4 packet view
+/// @return True if the frame holds a usable IPv4 packet
+static bool FindIpv4(unsigned int linkType, unsigned char* frame,
+                     unsigned int caplen, PcapPacket* pkt)
+{
+   unsigned int offset;
+
+   switch(linkType)
+   {
+      case LINKTYPE_ETHERNET :
+      {
+         offset = 12;
+         if(caplen < offset + 2) return false;
+         unsigned int etherType = ReadBe16(frame + offset);
+         while((etherType == ETHERTYPE_VLAN || etherType == ETHERTYPE_QINQ ||
+                etherType == ETHERTYPE_QINQ_OLD) && caplen >= offset + 6)
+         {
+            offset += 4;
+            etherType = ReadBe16(frame + offset);
+         }
+         if(etherType != ETHERTYPE_IPV4) return false;
+         offset += 2;
+         break;
+      }
+
+      case LINKTYPE_RAW :
+      case LINKTYPE_RAW_OLD :
+      case LINKTYPE_IPV4 :
+         offset = 0;
+         break;
+
+      case LINKTYPE_LINUX_SLL :
+         if(caplen < 16 || ReadBe16(frame + 14) != ETHERTYPE_IPV4) return false;
+         offset = 16;
+         break;
+
+      case LINKTYPE_LINUX_SLL2 :
+         if(caplen < 20 || ReadBe16(frame) != ETHERTYPE_IPV4) return false;
+         offset = 20;
+         break;
+
+      case LINKTYPE_NULL :
+      case LINKTYPE_LOOP :
+      {
+         // The address family is in the capturing host's byte order for
+         // NULL and big endian for LOOP, so accept AF_INET either way
+         if(caplen < 4) return false;
+         unsigned int family;
+         memcpy(&family, frame, sizeof(unsigned int));
+         if(family != 2 && __builtin_bswap32(family) != 2) return false;
+         offset = 4;
+         break;
+      }
+
+      default :
+         return false;
+   }
+
+   unsigned char* ip = frame + offset;
+   unsigned int length = caplen - offset;
+   if(length < 20 || (ip[0] >> 4) != 4 || (ip[0] & 0x0F) < 5) return false;
+
+   unsigned int headerLen = (ip[0] & 0x0F) * 4;
+   unsigned int totalLen = ReadBe16(ip + 2);
+   if(totalLen >= headerLen && totalLen < length) length = totalLen;
+
+   if(!PacketIsFilterable(ip, length)) return false;
+
+   pkt->data = ip;
+   pkt->length = length;
+   return true;
+}
+
+
+/// Reads a big endian 16 bit value
+/// @param p The value's location
+/// @return The value in host byte order
+static unsigned int ReadBe16(unsigned char* p)
+{
+   return ((unsigned int)p[0] << 8) | p[1];
+}
@@ -0,0 +1,111 @@
+#ifndef __PCAP_H__
+#define __PCAP_H__
+/// \file pcap.h
+/// \brief Streaming readers and writers for pcap and pcapng capture files.
+///
+/// The reader hands back IPv4 packets with the link-layer header already
+/// skipped. Each packet is a view into the reader's memory and is only
+/// valid until the next call to NextPcapPacket(). Files are memory-mapped
+/// where possible, and read through a buffer otherwise (pipes, stdin).
+///
+/// The writer stores packets with the raw IPv4 link type, so the packets
+/// it is given are written as-is with no link-layer header.
+///
+
+#include <stdbool.h>
+
+
+/// The on-disk formats understood by the reader and writer
+typedef enum PcapFormat_e
+{
+   PCAP_FORMAT_PCAP,
+   PCAP_FORMAT_PCAPNG
+} PcapFormat;
+
+
+/// An IPv4 packet read from a capture
+typedef struct PcapPacket_S
+{
+   /// Start of the IPv4 header
+   unsigned char* data;
+
+   /// Bytes available from the start of the IPv4 header
+   unsigned int length;
+
+   /// Capture time in nanoseconds since the epoch
+   unsigned long long timestamp;
+} PcapPacket;
+
+
+/// The type used by the client to read a pcap or pcapng file
+typedef void* PcapReader;
+
+
+/// The type used by the client to write a pcap or pcapng file
+typedef void* PcapWriter;
+
+
+/// Checks whether a file starts with a pcap or pcapng magic number
+/// @param filename The file to check
+/// @return True if the file is a pcap or pcapng capture
+bool IsPcapFile(char* filename);
+
+
+/// Opens a pcap or pcapng file, detecting the format and byte order
+/// from the file header
+/// @param filename The capture file, or "-" for stdin
+/// @return The new reader, or NULL if the file could not be opened or
+/// is not a pcap/pcapng file
+PcapReader OpenPcapReader(char* filename);
+
+
+/// Finds the next IPv4 packet in the capture. Frames that do not hold an
+/// IPv4 packet, or whose captured length is too short for an IPv4
+/// header, are skipped and counted.
+/// @param reader The capture reader
+/// @param pkt Receives a view of the packet
+/// @return True if a packet was found, False at the end of the capture
+/// or on a malformed file
+bool NextPcapPacket(PcapReader reader, PcapPacket* pkt);
+
+
+/// Reports whether the reader stopped because of a malformed file
+/// @param reader The capture reader
+/// @return True if the capture was malformed or truncated
+bool PcapReaderFailed(PcapReader reader);
+
+
+/// Returns the number of frames skipped because they were not IPv4
+/// @param reader The capture reader
+/// @return The number of skipped frames
+unsigned long long PcapSkippedFrames(PcapReader reader);
+
+
+/// Closes a capture reader and frees its resources
+/// @param reader The capture reader
+void ClosePcapReader(PcapReader reader);
+
+
+/// Creates a capture file and writes its file header
+/// @param filename The file to create, or "-" for stdout
+/// @param format The capture format to write
+/// @return The new writer, or NULL if the file could not be created
+PcapWriter OpenPcapWriter(char* filename, PcapFormat format);
+
+
+/// Appends a raw IPv4 packet to the capture
+/// @param writer The capture writer
+/// @param pkt The start of the IPv4 header
+/// @param length The length of the packet
+/// @param timestamp Capture time in nanoseconds since the epoch
+/// @return True if successful
+bool WritePcapPacket(PcapWriter writer, unsigned char* pkt, unsigned int length,
+                     unsigned long long timestamp);
+
+
+/// Flushes and closes a capture writer
+/// @param writer The capture writer, which is destroyed
+/// @return True if successful
+bool ClosePcapWriter(PcapWriter writer);
+
+#endif
@@ -0,0 +1,340 @@
+/// \file pktConvert.c
+/// \brief Converts captures between the packets.N format and pcap/pcapng.
+///
+/// The input format is detected from the file header; input read from
+/// stdin ("-") must be pcap or pcapng. The output format
+/// is given with -f, or taken from the output file extension (.pcap or
+/// .pcapng), and is packets.N otherwise. Packets are copied straight
+/// from the input mapping to the output buffer. When writing packets.N,
+/// the sidecar index (see pktIndex.h) is built as the capture is written.
+///
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcap.h"
+#include "pktIndex.h"
+
+/// Buffer size used for a packets.N output file
+#define CONVERT_OUT_BUF_LEN (1 << 20)
+
+
+/// The capture formats the converter can write
+typedef enum OutFormat_e
+{
+   OUT_PACKETS,
+   OUT_PCAP,
+   OUT_PCAPNG
+} OutFormat;
+
+
+/// Totals reported when a conversion finishes
+typedef struct ConvertStats_S
+{
+   unsigned long long numPkts;
+   unsigned long long numBytes;
+   unsigned long long numSkipped;
+} ConvertStats;
+
+
+/// Reads the -f argument, or picks the output format from the extension
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param format Receives the output format
+/// @return True if the arguments are valid
+static bool ParseOptions(int argc, char* argv[], OutFormat* format);
+
+
+/// Converts a pcap or pcapng capture to packets.N
+/// @param inFile The pcap or pcapng file
+/// @param outFile The packets.N file to create
+/// @param stats Receives the totals
+/// @return True if successful
+static bool PcapToPackets(char* inFile, char* outFile, ConvertStats* stats);
+
+
+/// Converts a pcap or pcapng capture to pcap or pcapng
+/// @param inFile The pcap or pcapng file
+/// @param outFile The file to create
+/// @param format The format to write
+/// @param stats Receives the totals
+/// @return True if successful
+static bool PcapToPcap(char* inFile, char* outFile, PcapFormat format, ConvertStats* stats);
+
+
+/// Converts a packets.N capture to pcap or pcapng
+/// @param inFile The packets.N file
+/// @param outFile The file to create
+/// @param format The format to write
+/// @param stats Receives the totals
+/// @return True if successful
+static bool PacketsToPcap(char* inFile, char* outFile, PcapFormat format, ConvertStats* stats);
+
+
+/// The main function. Converts the input capture named on the command
+/// line and reports the conversion throughput.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @return EXIT_SUCCESS or EXIT_FAILURE
+int main(int argc, char* argv[])
+{
+   OutFormat format;
+   if(argc <= 2 || !ParseOptions(argc, argv, &format))
+   {
+      printf("usage: pktConvert inFile outFile [-f packets|pcap|pcapng]\n");
+      return EXIT_FAILURE;
+   }
+
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   ConvertStats stats;
+   memset(&stats, 0, sizeof(ConvertStats));
+
+   bool success;
+   PcapFormat pcapFormat = format == OUT_PCAPNG ? PCAP_FORMAT_PCAPNG : PCAP_FORMAT_PCAP;
+   // stdin cannot be probed without consuming it, so it must be pcap/pcapng
+   if(strcmp(argv[1], "-") != 0 && !IsPcapFile(argv[1]))
+   {
+      if(format == OUT_PACKETS)
+      {
+         printf("ERROR, %s is already in packets.N format\n", argv[1]);
+         return EXIT_FAILURE;
+      }
+      success = PacketsToPcap(argv[1], argv[2], pcapFormat, &stats);
+   }
+   else if(format == OUT_PACKETS)
+      success = PcapToPackets(argv[1], argv[2], &stats);
+   else
+      success = PcapToPcap(argv[1], argv[2], pcapFormat, &stats);
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+   if(seconds <= 0) seconds = 1e-9;
+
+   // Diagnostics go to stderr in case the output is stdout
+   fprintf(stderr, "Converted %llu packets (%llu bytes, %llu frames skipped) in %.3f s\n",
+           stats.numPkts, stats.numBytes, stats.numSkipped, seconds);
+   fprintf(stderr, "Throughput: %.0f packets/sec, %.1f MB/s\n",
+           stats.numPkts / seconds, stats.numBytes / seconds / 1e6);
+
+   return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/// Reads the -f argument that may follow the file names. Without it, an
+/// output file ending in .pcap or .pcapng selects that format.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param format Receives the output format
+/// @return True if the arguments are valid
+static bool ParseOptions(int argc, char* argv[], OutFormat* format)
+{
+   size_t len = strlen(argv[2]);
+   if(len >= 7 && strcmp(argv[2] + len - 7, ".pcapng") == 0)
+      *format = OUT_PCAPNG;
+   else if(len >= 5 && strcmp(argv[2] + len - 5, ".pcap") == 0)
+      *format = OUT_PCAP;
+   else
+      *format = OUT_PACKETS;
+
+   int opt;
+   optind = 3;
+   while((opt = getopt(argc, argv, "f:")) != -1)
+   {
+      switch(opt)
+      {
+         case 'f' :
+            if(strcmp(optarg, "packets") == 0) *format = OUT_PACKETS;
+            else if(strcmp(optarg, "pcap") == 0) *format = OUT_PCAP;
+            else if(strcmp(optarg, "pcapng") == 0) *format = OUT_PCAPNG;
+            else return false;
+            break;
+
+         default :
+            return false;
+      }
+   }
+
+   return optind == argc;
+}
+
+
+/// Converts a pcap or pcapng capture to packets.N. The packet count is
+/// not known until the end, so a placeholder is written first and filled
+/// in once every packet has been written; the output must be seekable.
+/// @param inFile The pcap or pcapng file
+/// @param outFile The packets.N file to create
+/// @param stats Receives the totals
+/// @return True if successful
+static bool PcapToPackets(char* inFile, char* outFile, ConvertStats* stats)
+{
+   PcapReader reader = OpenPcapReader(inFile);
+   if(reader == NULL) return false;
+
+   FILE* pFile = fopen(outFile, "wb");
+   if(pFile == NULL)
+   {
+      perror("ERROR, failed to open output file:");
+      ClosePcapReader(reader);
+      return false;
+   }
+   setvbuf(pFile, NULL, _IOFBF, CONVERT_OUT_BUF_LEN);
+
+   char* indexFile = PktIndexFileName(outFile);
+   PktIndexWriter indexWriter = NULL;
+   if(indexFile != NULL)
+      indexWriter = OpenPktIndexWriter(indexFile, pFile, PKT_INDEX_DEFAULT_BLOCK_PKTS);
+   free(indexFile);
+
+   int count = 0;
+   fwrite(&count, sizeof(int), 1, pFile);
+
+   bool success = true;
+   PcapPacket pkt;
+   while(NextPcapPacket(reader, &pkt))
+   {
+      int length = (int)pkt.length;
+      fwrite(&length, sizeof(int), 1, pFile);
+      fwrite(pkt.data, 1, pkt.length, pFile);
+      if(indexWriter != NULL && !WritePktIndexFrame(indexWriter, pkt.length))
+         success = false;
+
+      stats->numPkts++;
+      stats->numBytes += pkt.length;
+   }
+   stats->numSkipped = PcapSkippedFrames(reader);
+
+   if(PcapReaderFailed(reader))
+      fprintf(stderr, "WARNING, %s is malformed or truncated, converted the packets before it\n", inFile);
+
+   count = (int)stats->numPkts;
+   if(fseek(pFile, 0, SEEK_SET) != 0 || fwrite(&count, sizeof(int), 1, pFile) != 1)
+      success = false;
+
+   if(ferror(pFile)) success = false;
+   if(fclose(pFile) != 0) success = false;
+   if(indexWriter != NULL && !ClosePktIndexWriter(indexWriter)) success = false;
+   if(!success) fprintf(stderr, "ERROR, failed writing %s\n", outFile);
+
+   ClosePcapReader(reader);
+   return success;
+}
+
+
+/// Converts a pcap or pcapng capture to pcap or pcapng. Link-layer
+/// headers and non-IPv4 frames are dropped along the way.
+/// @param inFile The pcap or pcapng file
+/// @param outFile The file to create
+/// @param format The format to write
+/// @param stats Receives the totals
+/// @return True if successful
+static bool PcapToPcap(char* inFile, char* outFile, PcapFormat format, ConvertStats* stats)
+{
+   PcapReader reader = OpenPcapReader(inFile);
+   if(reader == NULL) return false;
+
+   PcapWriter writer = OpenPcapWriter(outFile, format);
+   if(writer == NULL)
+   {
+      ClosePcapReader(reader);
+      return false;
+   }
+
+   bool success = true;
+   PcapPacket pkt;
+   while(success && NextPcapPacket(reader, &pkt))
+   {
+      success = WritePcapPacket(writer, pkt.data, pkt.length, pkt.timestamp);
+      stats->numPkts++;
+      stats->numBytes += pkt.length;
+   }
+   stats->numSkipped = PcapSkippedFrames(reader);
+
+   if(PcapReaderFailed(reader))
+      fprintf(stderr, "WARNING, %s is malformed or truncated, converted the packets before it\n", inFile);
+
+   if(!ClosePcapWriter(writer)) success = false;
+   if(!success) fprintf(stderr, "ERROR, failed writing %s\n", outFile);
+
+   ClosePcapReader(reader);
+   return success;
+}
+
+
+/// Converts a packets.N capture to pcap or pcapng. The packets.N format
+/// has no timestamps, so every packet is written with a zero timestamp.
+/// @param inFile The packets.N file
+/// @param outFile The file to create
+/// @param format The format to write
+/// @param stats Receives the totals
+/// @return True if successful
+static bool PacketsToPcap(char* inFile, char* outFile, PcapFormat format, ConvertStats* stats)
+{
+   int fd = open(inFile, O_RDONLY);
+   if(fd < 0)
+   {
+      perror("ERROR, failed to open input file:");
+      return false;
+   }
+
+   struct stat st;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(int))
+   {
+      fprintf(stderr, "ERROR, capture file %s is empty or unreadable\n", inFile);
+      close(fd);
+      return false;
+   }
+
+   size_t size = (size_t)st.st_size;
+   unsigned char* capture = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(capture == MAP_FAILED)
+   {
+      perror("ERROR, failed to map input file:");
+      return false;
+   }
+   posix_madvise(capture, size, POSIX_MADV_SEQUENTIAL);
+
+   PcapWriter writer = OpenPcapWriter(outFile, format);
+   if(writer == NULL)
+   {
+      munmap(capture, size);
+      return false;
+   }
+
+   int count;
+   memcpy(&count, capture, sizeof(int));
+
+   bool success = true;
+   size_t offset = sizeof(int);
+   while(success && count > 0 && stats->numPkts < (unsigned long long)count)
+   {
+      int length;
+      if(size - offset < sizeof(int)) break;
+      memcpy(&length, capture + offset, sizeof(int));
+      if(length < 0 || size - offset - sizeof(int) < (size_t)length) break;
+
+      success = WritePcapPacket(writer, capture + offset + sizeof(int), (unsigned int)length, 0);
+      offset += sizeof(int) + (size_t)length;
+      stats->numPkts++;
+      stats->numBytes += (unsigned long long)length;
+   }
+
+   if(count > 0 && stats->numPkts < (unsigned long long)count)
+      fprintf(stderr, "WARNING, %s is truncated after %llu of %d packets\n", inFile, stats->numPkts, count);
+
+   if(!ClosePcapWriter(writer)) success = false;
+   if(!success) fprintf(stderr, "ERROR, failed writing %s\n", outFile);
+
+   munmap(capture, size);
+   return success;
+}
@@ -0,0 +1,462 @@
+/// \file pktIndex.c
+/// \brief Seekable index for packets.N capture files.
+///
+/// The index file is written with pwrite() so that a writer can append
+/// block entries and then rewrite the header in place. A block entry is
+/// only written once the capture stream has been flushed past the frames
+/// it covers, and the header only after the entries it refers to, so a
+/// reader of a capture that is still being written sees a consistent
+/// prefix.
+///
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pktIndex.h"
+
+#define PKT_INDEX_MAGIC   "PKIX"
+#define PKT_INDEX_VERSION 1
+
+
+/// The on-disk header of an index file
+typedef struct PktIndexHeader_S
+{
+   char magic[4];
+   unsigned int version;
+   unsigned int blockPkts;
+   unsigned int numBlocks;
+   unsigned int numPkts;
+   unsigned int reserved;
+   unsigned long long captureSize;
+} PktIndexHeader;
+
+
+/// The state of an index that is written alongside a capture
+typedef struct IndexWriter_S
+{
+   PktIndex* index;
+   FILE* capture;
+   int fd;
+   unsigned int numFlushed;
+} IndexWriter;
+
+
+/// Writes the index header to the start of an index file
+/// @param fd The open index file
+/// @param index The index described by the header
+/// @param numBlocks Number of block entries in the file
+/// @param numPkts Number of packets covered by those entries
+/// @param captureSize Capture bytes covered by those entries
+/// @return True if successful
+static bool WriteHeader(int fd, PktIndex* index, unsigned int numBlocks,
+                        unsigned int numPkts, unsigned long long captureSize);
+
+
+/// Writes a range of block entries to an index file
+/// @param fd The open index file
+/// @param index The index holding the entries
+/// @param first The first entry to write
+/// @param end One past the last entry to write
+/// @return True if successful
+static bool WriteBlocks(int fd, PktIndex* index, unsigned int first, unsigned int end);
+
+
+/// Checks that the block entries read from an index file are consistent
+/// with each other and with the header
+/// @param index The index that was read
+/// @return True if the entries are consistent
+static bool ValidBlocks(PktIndex* index);
+
+
+/// Creates an empty index with room for a few blocks
+/// @param blockPkts Number of packets per block
+/// @return A pointer to the new index, or NULL if out of memory
+PktIndex* CreatePktIndex(unsigned int blockPkts)
+{
+   PktIndex* index = malloc(sizeof(PktIndex));
+   if(index == NULL) return NULL;
+
+   index->blockPkts = blockPkts > 0 ? blockPkts : PKT_INDEX_DEFAULT_BLOCK_PKTS;
+   index->numPkts = 0;
+   index->captureSize = sizeof(int);
+   index->numBlocks = 0;
+   index->maxBlocks = 16;
+   index->blocks = malloc(sizeof(PktIndexBlock) * index->maxBlocks);
+   if(index->blocks == NULL)
+   {
+      free(index);
+      return NULL;
+   }
+
+   return index;
+}
+
+
+/// Destroys an index and frees all of its memory
+/// @param index The index to destroy
+void DestroyPktIndex(PktIndex* index)
+{
+   if(index == NULL) return;
+
+   free(index->blocks);
+   free(index);
+}
+
+
+/// Records the next frame of the capture. A new block is started every
+/// blockPkts frames, doubling the block array when it is full.
+/// @param index The index to add to
+/// @param offset File offset of the frame's length field
+/// @param length Length of the frame, excluding the length field
+/// @return True if successful
+bool AddPktIndexFrame(PktIndex* index, unsigned long long offset, unsigned int length)
+{
+   if(index->numPkts % index->blockPkts == 0)
+   {
+      if(index->numBlocks == index->maxBlocks)
+      {
+         PktIndexBlock* pTemp = realloc(index->blocks, sizeof(PktIndexBlock) * index->maxBlocks * 2);
+         if(pTemp == NULL) return false;
+         index->blocks = pTemp;
+         index->maxBlocks *= 2;
+      }
+
+      index->blocks[index->numBlocks].offset = offset;
+      index->blocks[index->numBlocks].firstSeq = index->numPkts;
+      index->numBlocks++;
+   }
+
+   index->blocks[index->numBlocks - 1].lastSeq = index->numPkts;
+   index->numPkts++;
+   index->captureSize = offset + sizeof(int) + length;
+   return true;
+}
+
+
+/// Walks the frames of the capture starting where the index leaves off,
+/// checking each frame against the end of the file.
+/// @param index The index to extend, may be empty
+/// @param capture The capture file contents, starting with the packet count
+/// @param size Size of the capture in bytes
+/// @return The number of packets the capture claims to hold that could
+/// not be indexed because the file ends early
+unsigned int ExtendPktIndex(PktIndex* index, unsigned char* capture, size_t size)
+{
+   int count = 0;
+   if(size >= sizeof(int)) memcpy(&count, capture, sizeof(int));
+   if(count < 0) count = 0;
+
+   size_t offset = (size_t)index->captureSize;
+   while(index->numPkts < (unsigned int)count)
+   {
+      int length;
+      if(offset > size || size - offset < sizeof(int)) break;
+      memcpy(&length, capture + offset, sizeof(int));
+      if(length < 0 || size - offset - sizeof(int) < (size_t)length) break;
+
+      if(!AddPktIndexFrame(index, offset, (unsigned int)length)) break;
+      offset += sizeof(int) + (size_t)length;
+   }
+
+   return index->numPkts < (unsigned int)count ? (unsigned int)count - index->numPkts : 0;
+}
+
+
+/// Reads and validates an index sidecar file
+/// @param filename The index file to read
+/// @return The index, or NULL if it is missing or invalid
+PktIndex* ReadPktIndex(char* filename)
+{
+   FILE* pFile = fopen(filename, "rb");
+   if(pFile == NULL) return NULL;
+
+   PktIndexHeader header;
+   if(fread(&header, sizeof(PktIndexHeader), 1, pFile) != 1 ||
+      memcmp(header.magic, PKT_INDEX_MAGIC, 4) != 0 ||
+      header.version != PKT_INDEX_VERSION || header.blockPkts == 0 ||
+      header.numBlocks != ((unsigned long long)header.numPkts + header.blockPkts - 1) / header.blockPkts)
+   {
+      fclose(pFile);
+      return NULL;
+   }
+
+   PktIndex* index = CreatePktIndex(header.blockPkts);
+   if(index == NULL)
+   {
+      fclose(pFile);
+      return NULL;
+   }
+
+   if(header.numBlocks > index->maxBlocks)
+   {
+      PktIndexBlock* pTemp = realloc(index->blocks, sizeof(PktIndexBlock) * header.numBlocks);
+      if(pTemp == NULL)
+      {
+         DestroyPktIndex(index);
+         fclose(pFile);
+         return NULL;
+      }
+      index->blocks = pTemp;
+      index->maxBlocks = header.numBlocks;
+   }
+
+   if(fread(index->blocks, sizeof(PktIndexBlock), header.numBlocks, pFile) != header.numBlocks)
+   {
+      DestroyPktIndex(index);
+      fclose(pFile);
+      return NULL;
+   }
+   fclose(pFile);
+
+   index->numBlocks = header.numBlocks;
+   index->numPkts = header.numPkts;
+   index->captureSize = header.captureSize;
+   if(!ValidBlocks(index))
+   {
+      DestroyPktIndex(index);
+      return NULL;
+   }
+
+   return index;
+}
+
+
+/// Checks that an index describes the capture it was loaded for. The
+/// header must not claim more packets or bytes than the capture holds,
+/// and the frames of the last block are walked to make sure they end
+/// exactly where the index says, so that extending the index resumes at
+/// a frame boundary. This catches most indexes left next to a capture
+/// that was regenerated under the same name, but the other blocks are
+/// only checked as they are used.
+/// @param index The index
+/// @param capture The capture file contents, starting with the packet count
+/// @param size Size of the capture in bytes
+/// @return True if the index can be used with the capture
+bool PktIndexMatches(PktIndex* index, unsigned char* capture, size_t size)
+{
+   int count = 0;
+   if(size >= sizeof(int)) memcpy(&count, capture, sizeof(int));
+
+   if(count < 0 || index->numPkts > (unsigned int)count || index->captureSize > size)
+      return false;
+   if(index->numBlocks == 0) return index->captureSize == sizeof(int);
+
+   PktIndexBlock* last = &index->blocks[index->numBlocks - 1];
+   size_t offset = (size_t)last->offset;
+   size_t end = (size_t)index->captureSize;
+   unsigned int numFrames = 0;
+   while(offset < end)
+   {
+      int length;
+      if(end - offset < sizeof(int)) return false;
+      memcpy(&length, capture + offset, sizeof(int));
+      if(length < 0 || end - offset - sizeof(int) < (size_t)length) return false;
+
+      offset += sizeof(int) + (size_t)length;
+      numFrames++;
+   }
+
+   return numFrames == PktIndexBlockPkts(index, index->numBlocks - 1);
+}
+
+
+/// Returns the sequence number of the first packet of a block
+/// @param index The index
+/// @param block The block number
+/// @return The first packet of the block
+unsigned int PktIndexFirstPkt(PktIndex* index, unsigned int block)
+{
+   return block * index->blockPkts;
+}
+
+
+/// Returns the number of packets in a block. Every block but the last
+/// holds blockPkts packets.
+/// @param index The index
+/// @param block The block number
+/// @return The number of packets in the block
+unsigned int PktIndexBlockPkts(PktIndex* index, unsigned int block)
+{
+   unsigned int first = PktIndexFirstPkt(index, block);
+   return index->numPkts - first < index->blockPkts ? index->numPkts - first : index->blockPkts;
+}
+
+
+/// Writes an index to a sidecar file, replacing any existing file
+/// @param index The index to write
+/// @param filename The index file to create
+/// @return True if successful
+bool WritePktIndex(PktIndex* index, char* filename)
+{
+   int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if(fd < 0)
+   {
+      perror("ERROR, failed to open index file:");
+      return false;
+   }
+
+   bool success = WriteBlocks(fd, index, 0, index->numBlocks) &&
+                  WriteHeader(fd, index, index->numBlocks, index->numPkts, index->captureSize);
+
+   if(close(fd) != 0) success = false;
+   if(!success) printf("ERROR, failed writing %s\n", filename);
+   return success;
+}
+
+
+/// Builds the name of the sidecar index file for a capture file
+/// @param captureFile The capture file name
+/// @return A dynamically allocated file name the caller must free
+char* PktIndexFileName(char* captureFile)
+{
+   size_t len = strlen(captureFile);
+   char* filename = malloc(len + sizeof(PKT_INDEX_SUFFIX));
+   if(filename == NULL) return NULL;
+
+   memcpy(filename, captureFile, len);
+   memcpy(filename + len, PKT_INDEX_SUFFIX, sizeof(PKT_INDEX_SUFFIX));
+   return filename;
+}
+
+
+/// Creates an index file for a capture that is about to be written and
+/// writes an empty header to it.
+/// @param filename The index file to create
+/// @param capture The stream the capture is being written to
+/// @param blockPkts Number of packets per block
+/// @return The new writer, or NULL if the file could not be created
+PktIndexWriter OpenPktIndexWriter(char* filename, FILE* capture, unsigned int blockPkts)
+{
+   IndexWriter* writer = malloc(sizeof(IndexWriter));
+   if(writer == NULL) return NULL;
+
+   writer->index = CreatePktIndex(blockPkts);
+   writer->capture = capture;
+   writer->numFlushed = 0;
+   writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if(writer->index == NULL || writer->fd < 0 ||
+      !WriteHeader(writer->fd, writer->index, 0, 0, sizeof(int)))
+   {
+      perror("ERROR, failed to open index file:");
+      if(writer->fd >= 0) close(writer->fd);
+      DestroyPktIndex(writer->index);
+      free(writer);
+      return NULL;
+   }
+
+   return writer;
+}
+
+
+/// Records the next frame written to the capture. Once the frame fills a
+/// block, the capture stream is flushed so that every frame the block
+/// covers is in the file, and the capture's packet count is raised to
+/// cover them too. Only then is the block entry written, followed by an
+/// updated header.
+/// @param writer The index writer
+/// @param length Length of the frame, excluding the length field
+/// @return True if successful
+bool WritePktIndexFrame(PktIndexWriter writer, unsigned int length)
+{
+   IndexWriter* idxWriter = writer;
+   PktIndex* index = idxWriter->index;
+
+   if(!AddPktIndexFrame(index, index->captureSize, length)) return false;
+   if(index->numPkts % index->blockPkts != 0) return true;
+
+   int count = (int)index->numPkts;
+   if(fflush(idxWriter->capture) != 0) return false;
+   if(pwrite(fileno(idxWriter->capture), &count, sizeof(int), 0) != sizeof(int)) return false;
+   if(!WriteBlocks(idxWriter->fd, index, idxWriter->numFlushed, index->numBlocks)) return false;
+   idxWriter->numFlushed = index->numBlocks;
+   return WriteHeader(idxWriter->fd, index, index->numBlocks, index->numPkts, index->captureSize);
+}
+
+
+/// Writes the last, partial block and closes the index file
+/// @param writer The index writer, which is destroyed
+/// @return True if successful
+bool ClosePktIndexWriter(PktIndexWriter writer)
+{
+   IndexWriter* idxWriter = writer;
+   PktIndex* index = idxWriter->index;
+
+   bool success = WriteBlocks(idxWriter->fd, index, idxWriter->numFlushed, index->numBlocks) &&
+                  WriteHeader(idxWriter->fd, index, index->numBlocks, index->numPkts, index->captureSize);
+   if(close(idxWriter->fd) != 0) success = false;
+
+   DestroyPktIndex(index);
+   free(idxWriter);
+   return success;
+}
+
+
+/// Writes the index header to the start of an index file
+/// @param fd The open index file
+/// @param index The index described by the header
+/// @param numBlocks Number of block entries in the file
+/// @param numPkts Number of packets covered by those entries
+/// @param captureSize Capture bytes covered by those entries
+/// @return True if successful
+static bool WriteHeader(int fd, PktIndex* index, unsigned int numBlocks,
+                        unsigned int numPkts, unsigned long long captureSize)
+{
+   PktIndexHeader header;
+   memset(&header, 0, sizeof(PktIndexHeader));
+   memcpy(header.magic, PKT_INDEX_MAGIC, 4);
+   header.version = PKT_INDEX_VERSION;
+   header.blockPkts = index->blockPkts;
+   header.numBlocks = numBlocks;
+   header.numPkts = numPkts;
+   header.captureSize = captureSize;
+
+   return pwrite(fd, &header, sizeof(PktIndexHeader), 0) == (ssize_t)sizeof(PktIndexHeader);
+}
+
+
+/// Writes a range of block entries to an index file
+/// @param fd The open index file
+/// @param index The index holding the entries
+/// @param first The first entry to write
+/// @param end One past the last entry to write
+/// @return True if successful
+static bool WriteBlocks(int fd, PktIndex* index, unsigned int first, unsigned int end)
+{
+   if(first >= end) return true;
+
+   size_t len = sizeof(PktIndexBlock) * (end - first);
+   off_t offset = (off_t)(sizeof(PktIndexHeader) + sizeof(PktIndexBlock) * first);
+   return pwrite(fd, &index->blocks[first], len, offset) == (ssize_t)len;
+}
+
+
+/// Checks that the block entries read from an index file are consistent.
+/// The sequence numbers stored for block b must be the ones its block
+/// number implies, and the block offsets must start right after the
+/// packet count, increase strictly and stay below the end of the indexed
+/// part of the capture.
+/// @param index The index that was read
+/// @return True if the entries are consistent
+static bool ValidBlocks(PktIndex* index)
+{
+   if(index->numBlocks == 0) return index->captureSize == sizeof(int);
+   if(index->blocks[0].offset != sizeof(int)) return false;
+
+   for(unsigned int b = 0; b < index->numBlocks; b++)
+   {
+      PktIndexBlock* block = &index->blocks[b];
+      unsigned int firstPkt = PktIndexFirstPkt(index, b);
+
+      if(block->firstSeq != firstPkt ||
+         block->lastSeq != firstPkt + PktIndexBlockPkts(index, b) - 1)
+         return false;
+      if(b > 0 && block->offset <= index->blocks[b - 1].offset) return false;
+   }
+
+   return index->blocks[index->numBlocks - 1].offset < index->captureSize;
+}
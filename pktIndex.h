@@ -0,0 +1,164 @@
+#ifndef __PKT_INDEX_H__
+#define __PKT_INDEX_H__
+/// \file pktIndex.h
+/// \brief Seekable index for packets.N capture files.
+///
+/// A packets.N capture is an int packet count followed by [int len][bytes]
+/// frames, so it can only be walked from the front. The index records the
+/// file offset of every blockPkts'th frame, which lets a capture be split
+/// into disjoint ranges for several threads. The index is kept in a
+/// sidecar file named after the capture with PKT_INDEX_SUFFIX appended.
+///
+/// Block b holds packets b * blockPkts onwards, so the packet range of a
+/// block follows from its number (see PktIndexFirstPkt()). The first and
+/// last sequence numbers stored with each entry are redundant. They are
+/// only checked when an index is read, to reject damaged files.
+///
+/// Sidecar layout, in host byte order like the capture itself:
+///    char magic[4] "PKIX", unsigned int version, blockPkts, numBlocks,
+///    numPkts, reserved, unsigned long long captureSize
+/// followed by numBlocks entries of
+///    unsigned long long offset, unsigned int firstSeq, lastSeq
+///
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+
+/// Appended to a capture file name to form the name of its index
+#define PKT_INDEX_SUFFIX ".idx"
+
+/// Default number of packets per indexed block
+#define PKT_INDEX_DEFAULT_BLOCK_PKTS 4096
+
+
+/// Location of one block of packets. The sequence numbers are written for
+/// each entry but are derived from the block number when used.
+typedef struct PktIndexBlock_S
+{
+   unsigned long long offset;
+   unsigned int firstSeq;
+   unsigned int lastSeq;
+} PktIndexBlock;
+
+
+/// An in-memory capture index
+typedef struct PktIndex_S
+{
+   unsigned int blockPkts;
+   unsigned int numPkts;
+   unsigned long long captureSize;
+   unsigned int numBlocks;
+   unsigned int maxBlocks;
+   PktIndexBlock* blocks;
+} PktIndex;
+
+
+/// The type used by the client to build an index file while the
+/// capture it describes is being written
+typedef void* PktIndexWriter;
+
+
+/// Creates an empty index
+/// @param blockPkts Number of packets per block
+/// @return A pointer to the new index, or NULL if out of memory
+PktIndex* CreatePktIndex(unsigned int blockPkts);
+
+
+/// Destroys an index and frees all of its memory
+/// @param index The index to destroy
+void DestroyPktIndex(PktIndex* index);
+
+
+/// Records the next frame of the capture in the index
+/// @param index The index to add to
+/// @param offset File offset of the frame's length field
+/// @param length Length of the frame, excluding the length field
+/// @return True if successful
+bool AddPktIndexFrame(PktIndex* index, unsigned long long offset, unsigned int length);
+
+
+/// Indexes the frames of a mapped capture that the index does not cover
+/// yet, so an index of a capture that has since grown can be brought up
+/// to date without rescanning the front of the file.
+/// @param index The index to extend, may be empty
+/// @param capture The capture file contents, starting with the packet count
+/// @param size Size of the capture in bytes
+/// @return The number of packets the capture claims to hold that could
+/// not be indexed because the file ends early
+unsigned int ExtendPktIndex(PktIndex* index, unsigned char* capture, size_t size);
+
+
+/// Reads an index sidecar file and checks that its block entries are
+/// consistent with each other
+/// @param filename The index file to read
+/// @return The index, or NULL if it is missing or invalid
+PktIndex* ReadPktIndex(char* filename);
+
+
+/// Checks that an index read from disk matches the capture it is used with
+/// @param index The index
+/// @param capture The capture file contents, starting with the packet count
+/// @param size Size of the capture in bytes
+/// @return True if the index can be used with the capture
+bool PktIndexMatches(PktIndex* index, unsigned char* capture, size_t size);
+
+
+/// Returns the sequence number of the first packet of a block
+/// @param index The index
+/// @param block The block number
+/// @return The first packet of the block
+unsigned int PktIndexFirstPkt(PktIndex* index, unsigned int block);
+
+
+/// Returns the number of packets in a block
+/// @param index The index
+/// @param block The block number
+/// @return The number of packets in the block
+unsigned int PktIndexBlockPkts(PktIndex* index, unsigned int block);
+
+
+/// Writes an index to a sidecar file
+/// @param index The index to write
+/// @param filename The index file to create
+/// @return True if successful
+bool WritePktIndex(PktIndex* index, char* filename);
+
+
+/// Builds the name of the sidecar index file for a capture file
+/// @param captureFile The capture file name
+/// @return A dynamically allocated file name the caller must free
+char* PktIndexFileName(char* captureFile);
+
+
+/// Creates an index file that is updated as frames are added, for use
+/// while the capture it describes is being written. As soon as a block is
+/// full the capture stream is flushed and the packet count at the start of
+/// the capture is updated, and then the block entry is written, so the
+/// file always describes a valid prefix of the capture. The capture must
+/// be a regular file.
+/// @param filename The index file to create
+/// @param capture The stream the capture is being written to
+/// @param blockPkts Number of packets per block
+/// @return The new writer, or NULL if the file could not be created
+PktIndexWriter OpenPktIndexWriter(char* filename, FILE* capture, unsigned int blockPkts);
+
+
+/// Records the next frame written to the capture, which must already have
+/// been passed to the capture stream. The first frame is assumed to
+/// follow the int packet count at the start of the capture.
+/// @param writer The index writer
+/// @param length Length of the frame, excluding the length field
+/// @return True if successful
+bool WritePktIndexFrame(PktIndexWriter writer, unsigned int length);
+
+
+/// Writes the last, partial block and closes the index file. The capture
+/// stream is not used, and should be closed first so the last block is
+/// only published once its frames are in the capture.
+/// @param writer The index writer, which is destroyed
+/// @return True if successful
+bool ClosePktIndexWriter(PktIndexWriter writer);
+
+#endif
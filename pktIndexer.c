@@ -0,0 +1,159 @@
+/// \file pktIndexer.c
+/// \brief Writes the sidecar index for a packets.N capture file so that
+/// replay can split the capture between threads without walking it first.
+///
+/// If the capture already has an index built with the same block size,
+/// only the frames added since it was written are walked.
+///
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pktIndex.h"
+
+
+/// Reads the optional -k argument
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param blockPkts Receives the number of packets per block
+/// @return True if the arguments are valid
+static bool ParseOptions(int argc, char* argv[], unsigned int* blockPkts);
+
+
+/// Loads the existing index of a capture, if there is one that was built
+/// with the requested block size and still matches the capture.
+/// @param indexFile The index file name
+/// @param blockPkts The requested number of packets per block
+/// @param capture The capture file contents
+/// @param size Size of the capture in bytes
+/// @return The index, or a new empty index
+static PktIndex* LoadExistingIndex(char* indexFile, unsigned int blockPkts,
+                                   unsigned char* capture, size_t size);
+
+
+/// The main function. Maps the capture named on the command line, brings
+/// its index up to date and writes it next to the capture.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @return EXIT_SUCCESS or EXIT_FAILURE
+int main(int argc, char* argv[])
+{
+   unsigned int blockPkts = PKT_INDEX_DEFAULT_BLOCK_PKTS;
+   if(argc <= 1 || !ParseOptions(argc, argv, &blockPkts))
+   {
+      printf("usage: pktIndexer captureFile [-k blockPkts]\n");
+      return EXIT_FAILURE;
+   }
+
+   int fd = open(argv[1], O_RDONLY);
+   if(fd < 0)
+   {
+      perror("ERROR, failed to open capture file:");
+      return EXIT_FAILURE;
+   }
+
+   struct stat st;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(int))
+   {
+      printf("ERROR, capture file %s is empty or unreadable\n", argv[1]);
+      close(fd);
+      return EXIT_FAILURE;
+   }
+
+   size_t size = (size_t)st.st_size;
+   unsigned char* capture = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(capture == MAP_FAILED)
+   {
+      perror("ERROR, failed to map capture file:");
+      return EXIT_FAILURE;
+   }
+   posix_madvise(capture, size, POSIX_MADV_SEQUENTIAL);
+
+   char* indexFile = PktIndexFileName(argv[1]);
+   PktIndex* index = indexFile != NULL ? LoadExistingIndex(indexFile, blockPkts, capture, size) : NULL;
+   if(index == NULL)
+   {
+      printf("ERROR, out of memory indexing %s\n", argv[1]);
+      free(indexFile);
+      munmap(capture, size);
+      return EXIT_FAILURE;
+   }
+
+   unsigned int prevPkts = index->numPkts;
+   unsigned int missing = ExtendPktIndex(index, capture, size);
+   if(missing > 0)
+      printf("WARNING, %s is truncated, %u packets are missing\n", argv[1], missing);
+
+   bool success = WritePktIndex(index, indexFile);
+   if(success)
+      printf("Indexed %u packets (%u new) in %u blocks of %u, written to %s\n",
+             index->numPkts, index->numPkts - prevPkts, index->numBlocks,
+             index->blockPkts, indexFile);
+
+   DestroyPktIndex(index);
+   free(indexFile);
+   munmap(capture, size);
+   return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/// Reads the optional -k argument that may follow the capture file name.
+/// The block size must be a multiple of 8 so replay threads own whole
+/// bytes of the verdict bitmap.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param blockPkts Receives the number of packets per block
+/// @return True if the arguments are valid
+static bool ParseOptions(int argc, char* argv[], unsigned int* blockPkts)
+{
+   int opt;
+   optind = 2;
+   while((opt = getopt(argc, argv, "k:")) != -1)
+   {
+      switch(opt)
+      {
+         case 'k' :
+            if(sscanf(optarg, "%u", blockPkts) != 1) return false;
+            break;
+
+         default :
+            return false;
+      }
+   }
+
+   return optind == argc && *blockPkts > 0 && *blockPkts % 8 == 0;
+}
+
+
+/// Loads the existing index of a capture, if there is one that was built
+/// with the requested block size and still matches the capture (see
+/// PktIndexMatches()). Otherwise the capture is indexed from the start.
+/// @param indexFile The index file name
+/// @param blockPkts The requested number of packets per block
+/// @param capture The capture file contents
+/// @param size Size of the capture in bytes
+/// @return The index, or a new empty index
+static PktIndex* LoadExistingIndex(char* indexFile, unsigned int blockPkts,
+                                   unsigned char* capture, size_t size)
+{
+   PktIndex* index = ReadPktIndex(indexFile);
+
+   if(index != NULL && (index->blockPkts != blockPkts || !PktIndexMatches(index, capture, size)))
+   {
+      DestroyPktIndex(index);
+      index = NULL;
+   }
+
+   if(index == NULL)
+      index = CreatePktIndex(blockPkts);
+
+   return index;
+}
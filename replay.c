@@ -0,0 +1,617 @@
+/// \file replay.c
+/// \brief Filters a capture file offline, without going through the
+/// ToFirewall/FromFirewall named pipes.
+///
+/// The capture is mapped read-only and split into blocks using its
+/// sidecar index (see pktIndex.h). If there is no usable index, or it only
+/// covers the front of a capture that has since grown, the remaining
+/// frames are walked once to extend it. The blocks are split between the
+/// worker threads, which pass pointers into the mapping straight to
+/// FilterPacket() and record each verdict in a shared bitmap. Blocks are
+/// a multiple of 8 packets long, so no two threads ever touch the same
+/// bitmap byte. The allowed frames are then written out directly from the
+/// mapping, together with an index of the output.
+///
+/// pcap and pcapng captures cannot be split without walking them, so they
+/// are filtered on a single thread as they are streamed from the reader.
+///
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "pktIndex.h"
+#include "pcap.h"
+
+/// Upper bound on the number of filtering threads
+#define REPLAY_MAX_THREADS 256
+
+/// Buffer size used for the output files
+#define REPLAY_OUT_BUF_LEN (1 << 20)
+
+
+/// A capture file mapped into memory, along with its index
+typedef struct Capture_S
+{
+   unsigned char* base;
+   size_t size;
+   PktIndex* index;
+} Capture;
+
+
+/// The state of a single filtering thread
+typedef struct ReplayWorker_S
+{
+   IpPktFilter filter;
+   Capture* capture;
+   unsigned char* bitmap;
+   unsigned int firstBlock;
+   unsigned int endBlock;
+   unsigned int numAllowed;
+   unsigned int numShort;
+   bool corrupt;
+   bool started;
+} ReplayWorker;
+
+
+/// Maps a capture file into memory and loads or builds its index.
+/// @param filename The capture file to map
+/// @param capture Receives the mapping and index
+/// @return True if successful
+static bool MapCapture(char* filename, Capture* capture);
+
+
+/// Loads the sidecar index of a capture if it exists and can be used to
+/// split the capture between threads, otherwise creates an empty index.
+/// @param filename The capture file name
+/// @param capture The mapped capture
+/// @return The index, or NULL if out of memory
+static PktIndex* LoadCaptureIndex(char* filename, Capture* capture);
+
+
+/// Returns the offset one past the last frame of a block
+/// @param index The capture index
+/// @param block The block number
+/// @return The end offset of the block
+static size_t BlockEnd(PktIndex* index, unsigned int block);
+
+
+/// Unmaps a capture file and frees its index
+/// @param capture The capture to release
+static void UnmapCapture(Capture* capture);
+
+
+/// Filters every packet in the worker's range of blocks.
+/// The return value and parameter must match those expected by pthread_create.
+/// @param args A ReplayWorker
+/// @return Always NULL
+static void* ReplayThread(void* args);
+
+
+/// Writes the allowed frames, in their original order, in packets.N format
+/// @param filename The output file
+/// @param capture The capture the frames are taken from
+/// @param bitmap The verdict bitmap
+/// @param numAllowed Number of bits set in the bitmap
+/// @return True if successful
+static bool WriteAllowedFrames(char* filename, Capture* capture,
+                               unsigned char* bitmap, unsigned int numAllowed);
+
+
+/// Writes the packet count followed by the verdict bitmap
+/// @param filename The output file
+/// @param bitmap The verdict bitmap
+/// @param numPkts Number of packets covered by the bitmap
+/// @return True if successful
+static bool WriteBitmap(char* filename, unsigned char* bitmap, unsigned int numPkts);
+
+
+/// Filters a pcap or pcapng capture on a single thread, writing the
+/// allowed packets in packets.N format and the verdict bitmap.
+/// @param filter A configured filter instance
+/// @param opts The input/output files to use
+/// @return True if successful
+static bool ReplayPcap(IpPktFilter filter, ReplayOptions* opts);
+
+
+/// Returns the seconds elapsed between two monotonic clock readings
+static double ElapsedSeconds(struct timespec* start, struct timespec* end);
+
+
+/// Prints the replay summary
+/// @param numPkts Number of packets filtered
+/// @param numAllowed Number of packets allowed
+/// @param numThreads Number of filtering threads
+/// @param start When the replay started
+/// @param filtered When filtering finished
+/// @param end When the outputs were written
+static void PrintSummary(unsigned int numPkts, unsigned int numAllowed, unsigned int numThreads,
+                         struct timespec* start, struct timespec* filtered, struct timespec* end);
+
+
+/// Maps the capture, runs the filtering threads over it, writes the
+/// requested outputs and prints a summary.
+/// @param filter A configured filter instance
+/// @param opts The input/output files and thread count to use
+/// @return True if successful
+bool ReplayCapture(IpPktFilter filter, ReplayOptions* opts)
+{
+   if(IsPcapFile(opts->inFile)) return ReplayPcap(filter, opts);
+
+   struct timespec start, filtered, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   Capture capture;
+   if(!MapCapture(opts->inFile, &capture)) return false;
+   PktIndex* index = capture.index;
+
+   unsigned int numThreads = opts->numThreads;
+   if(numThreads == 0)
+   {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      numThreads = cpus > 0 ? (unsigned int)cpus : 1;
+   }
+   if(numThreads > REPLAY_MAX_THREADS) numThreads = REPLAY_MAX_THREADS;
+   if(numThreads > index->numBlocks) numThreads = index->numBlocks > 0 ? index->numBlocks : 1;
+
+   unsigned char* bitmap = calloc(index->numPkts / 8 + 1, 1);
+   ReplayWorker* workers = malloc(sizeof(ReplayWorker) * numThreads);
+   pthread_t* threads = malloc(sizeof(pthread_t) * numThreads);
+   if(bitmap == NULL || workers == NULL || threads == NULL)
+   {
+      printf("ERROR, out of memory replaying %s\n", opts->inFile);
+      free(bitmap); free(workers); free(threads);
+      UnmapCapture(&capture);
+      return false;
+   }
+
+   // Give each thread a contiguous run of blocks
+   for(unsigned int i = 0; i < numThreads; i++)
+   {
+      workers[i].filter = filter;
+      workers[i].capture = &capture;
+      workers[i].bitmap = bitmap;
+      workers[i].firstBlock = (unsigned int)((unsigned long)index->numBlocks * i / numThreads);
+      workers[i].endBlock = (unsigned int)((unsigned long)index->numBlocks * (i + 1) / numThreads);
+      workers[i].numAllowed = 0;
+      workers[i].numShort = 0;
+      workers[i].corrupt = false;
+
+      // If a thread cannot be started, its blocks are filtered here instead
+      workers[i].started = pthread_create(&threads[i], NULL, ReplayThread, &workers[i]) == 0;
+      if(!workers[i].started) ReplayThread(&workers[i]);
+   }
+
+   unsigned int numAllowed = 0;
+   unsigned int numShort = 0;
+   bool success = true;
+   for(unsigned int i = 0; i < numThreads; i++)
+   {
+      if(workers[i].started) pthread_join(threads[i], NULL);
+      numAllowed += workers[i].numAllowed;
+      numShort += workers[i].numShort;
+      if(workers[i].corrupt) success = false;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &filtered);
+
+   if(numShort > 0)
+      printf("WARNING, blocked %u frames too short to filter\n", numShort);
+
+   if(!success)
+      printf("ERROR, %s does not match its index, delete %s%s and retry\n",
+             opts->inFile, opts->inFile, PKT_INDEX_SUFFIX);
+   if(success && opts->outFile != NULL)
+      success = WriteAllowedFrames(opts->outFile, &capture, bitmap, numAllowed);
+   if(success && opts->bitmapFile != NULL)
+      success = WriteBitmap(opts->bitmapFile, bitmap, index->numPkts);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   PrintSummary(index->numPkts, numAllowed, numThreads, &start, &filtered, &end);
+
+   free(threads);
+   free(workers);
+   free(bitmap);
+   UnmapCapture(&capture);
+   return success;
+}
+
+
+/// Opens and maps the capture file, then loads its index and extends it
+/// over any frames it does not cover yet. Every frame walked here is
+/// bounds checked against the end of the file.
+/// @param filename The capture file to map
+/// @param capture Receives the mapping and index
+/// @return True if successful
+static bool MapCapture(char* filename, Capture* capture)
+{
+   memset(capture, 0, sizeof(Capture));
+
+   int fd = open(filename, O_RDONLY);
+   if(fd < 0)
+   {
+      perror("ERROR, failed to open capture file:");
+      return false;
+   }
+
+   struct stat st;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(int))
+   {
+      printf("ERROR, capture file %s is empty or unreadable\n", filename);
+      close(fd);
+      return false;
+   }
+
+   capture->size = (size_t)st.st_size;
+   capture->base = mmap(NULL, capture->size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(capture->base == MAP_FAILED)
+   {
+      perror("ERROR, failed to map capture file:");
+      capture->base = NULL;
+      return false;
+   }
+   posix_madvise(capture->base, capture->size, POSIX_MADV_SEQUENTIAL);
+
+   capture->index = LoadCaptureIndex(filename, capture);
+   if(capture->index == NULL)
+   {
+      printf("ERROR, out of memory indexing %s\n", filename);
+      UnmapCapture(capture);
+      return false;
+   }
+
+   unsigned int missing = ExtendPktIndex(capture->index, capture->base, capture->size);
+   if(missing > 0)
+      printf("WARNING, %s is truncated, %u packets are missing\n", filename, missing);
+
+   return true;
+}
+
+
+/// Loads the sidecar index of a capture. The index is only used if its
+/// blocks are a multiple of 8 packets and it matches the capture (see
+/// PktIndexMatches()), otherwise an empty index is returned in its place.
+/// @param filename The capture file name
+/// @param capture The mapped capture
+/// @return The index, or NULL if out of memory
+static PktIndex* LoadCaptureIndex(char* filename, Capture* capture)
+{
+   char* indexFile = PktIndexFileName(filename);
+   if(indexFile == NULL) return NULL;
+
+   PktIndex* index = ReadPktIndex(indexFile);
+   free(indexFile);
+
+   if(index != NULL &&
+      (index->blockPkts % 8 != 0 || !PktIndexMatches(index, capture->base, capture->size)))
+   {
+      printf("WARNING, ignoring unusable index for %s\n", filename);
+      DestroyPktIndex(index);
+      index = NULL;
+   }
+
+   if(index == NULL)
+      index = CreatePktIndex(PKT_INDEX_DEFAULT_BLOCK_PKTS);
+
+   return index;
+}
+
+
+/// Returns the offset one past the last frame of a block
+/// @param index The capture index
+/// @param block The block number
+/// @return The end offset of the block
+static size_t BlockEnd(PktIndex* index, unsigned int block)
+{
+   if(block + 1 < index->numBlocks)
+      return (size_t)index->blocks[block + 1].offset;
+
+   return (size_t)index->captureSize;
+}
+
+
+/// Unmaps a capture file and frees its index
+/// @param capture The capture to release
+static void UnmapCapture(Capture* capture)
+{
+   if(capture->base != NULL)
+      munmap(capture->base, capture->size);
+
+   DestroyPktIndex(capture->index);
+   memset(capture, 0, sizeof(Capture));
+}
+
+
+/// Runs as a thread and filters the packets of a range of blocks. Frames
+/// are passed to FilterPacket() as pointers into the mapped capture, and
+/// the verdicts are stored in the bitmap bytes owned by this thread.
+/// Frames too short for FilterPacket() (see PacketIsFilterable()) are
+/// blocked without being filtered, since it would read past them. The
+/// index may have been read from disk, so each block must hold exactly
+/// the frames the index says it does, ending exactly at the next block.
+/// Otherwise the worker stops and marks the capture corrupt.
+/// @param args A ReplayWorker
+/// @return Always NULL
+static void* ReplayThread(void* args)
+{
+   ReplayWorker* worker = args;
+   Capture* capture = worker->capture;
+   PktIndex* index = capture->index;
+
+   for(unsigned int b = worker->firstBlock; b < worker->endBlock; b++)
+   {
+      unsigned int pkt = PktIndexFirstPkt(index, b);
+      unsigned int endPkt = pkt + PktIndexBlockPkts(index, b);
+      size_t offset = (size_t)index->blocks[b].offset;
+      size_t end = BlockEnd(index, b);
+
+      while(offset < end && pkt < endPkt)
+      {
+         int length;
+         if(end - offset < sizeof(int)) break;
+         memcpy(&length, capture->base + offset, sizeof(int));
+         if(length < 0 || end - offset - sizeof(int) < (size_t)length) break;
+         unsigned char* packet = capture->base + offset + sizeof(int);
+
+         if(!PacketIsFilterable(packet, (unsigned int)length))
+            worker->numShort++;
+         else if(FilterPacket(worker->filter, packet))
+         {
+            worker->bitmap[pkt / 8] |= (unsigned char)(1 << (pkt % 8));
+            worker->numAllowed++;
+         }
+
+         offset += sizeof(int) + (size_t)length;
+         pkt++;
+      }
+
+      if(offset != end || pkt != endPkt)
+      {
+         worker->corrupt = true;
+         break;
+      }
+   }
+
+   return NULL;
+}
+
+
+/// Writes the allowed frames, in their original order, in packets.N format.
+/// The frames are written straight from the mapped capture, and an index
+/// of the output is built alongside it as it is written. Each frame is
+/// checked against the end of the indexed part of the capture.
+/// @param filename The output file
+/// @param capture The capture the frames are taken from
+/// @param bitmap The verdict bitmap
+/// @param numAllowed Number of bits set in the bitmap
+/// @return True if successful
+static bool WriteAllowedFrames(char* filename, Capture* capture,
+                               unsigned char* bitmap, unsigned int numAllowed)
+{
+   PktIndex* index = capture->index;
+
+   FILE* pFile = fopen(filename, "wb");
+   if(pFile == NULL)
+   {
+      perror("ERROR, failed to open replay output file:");
+      return false;
+   }
+   setvbuf(pFile, NULL, _IOFBF, REPLAY_OUT_BUF_LEN);
+
+   char* indexFile = PktIndexFileName(filename);
+   PktIndexWriter indexWriter = NULL;
+   if(indexFile != NULL)
+      indexWriter = OpenPktIndexWriter(indexFile, pFile, index->blockPkts);
+   free(indexFile);
+
+   int count = (int)numAllowed;
+   fwrite(&count, sizeof(int), 1, pFile);
+
+   bool success = true;
+   size_t offset = sizeof(int);
+   size_t end = (size_t)index->captureSize;
+   for(unsigned int pkt = 0; pkt < index->numPkts; pkt++)
+   {
+      int length;
+      if(end - offset < sizeof(int)) break;
+      memcpy(&length, capture->base + offset, sizeof(int));
+      if(length < 0 || end - offset - sizeof(int) < (size_t)length) break;
+      size_t frameLen = sizeof(int) + (size_t)length;
+
+      if(bitmap[pkt / 8] & (1 << (pkt % 8)))
+      {
+         fwrite(capture->base + offset, 1, frameLen, pFile);
+         if(indexWriter != NULL && !WritePktIndexFrame(indexWriter, (unsigned int)length))
+            success = false;
+      }
+
+      offset += frameLen;
+   }
+   if(offset != end)
+   {
+      printf("ERROR, capture does not match its index, %s is incomplete\n", filename);
+      success = false;
+   }
+
+   if(ferror(pFile)) success = false;
+   if(fclose(pFile) != 0) success = false;
+   if(indexWriter != NULL && !ClosePktIndexWriter(indexWriter)) success = false;
+   if(!success) printf("ERROR, failed writing %s\n", filename);
+   return success;
+}
+
+
+/// Writes the packet count followed by the verdict bitmap
+/// @param filename The output file
+/// @param bitmap The verdict bitmap
+/// @param numPkts Number of packets covered by the bitmap
+/// @return True if successful
+static bool WriteBitmap(char* filename, unsigned char* bitmap, unsigned int numPkts)
+{
+   FILE* pFile = fopen(filename, "wb");
+   if(pFile == NULL)
+   {
+      perror("ERROR, failed to open bitmap output file:");
+      return false;
+   }
+
+   int count = (int)numPkts;
+   fwrite(&count, sizeof(int), 1, pFile);
+   fwrite(bitmap, 1, (numPkts + 7) / 8, pFile);
+
+   bool success = !ferror(pFile);
+   if(fclose(pFile) != 0) success = false;
+   if(!success) printf("ERROR, failed writing %s\n", filename);
+   return success;
+}
+
+
+/// Streams the packets of a pcap or pcapng capture through the filter.
+/// Each packet is filtered in place in the reader's memory, and allowed
+/// packets are written with their link-layer header removed. The verdict
+/// bitmap grows as packets are read since the count is not known up front.
+/// @param filter A configured filter instance
+/// @param opts The input/output files to use
+/// @return True if successful
+static bool ReplayPcap(IpPktFilter filter, ReplayOptions* opts)
+{
+   struct timespec start, filtered, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   PcapReader reader = OpenPcapReader(opts->inFile);
+   if(reader == NULL) return false;
+
+   FILE* pFile = NULL;
+   PktIndexWriter indexWriter = NULL;
+   if(opts->outFile != NULL)
+   {
+      pFile = fopen(opts->outFile, "wb");
+      if(pFile == NULL)
+      {
+         perror("ERROR, failed to open replay output file:");
+         ClosePcapReader(reader);
+         return false;
+      }
+      setvbuf(pFile, NULL, _IOFBF, REPLAY_OUT_BUF_LEN);
+
+      char* indexFile = PktIndexFileName(opts->outFile);
+      if(indexFile != NULL)
+         indexWriter = OpenPktIndexWriter(indexFile, pFile, PKT_INDEX_DEFAULT_BLOCK_PKTS);
+      free(indexFile);
+
+      // The count is filled in once all packets have been filtered
+      int count = 0;
+      fwrite(&count, sizeof(int), 1, pFile);
+   }
+
+   bool success = true;
+   unsigned char* bitmap = NULL;
+   size_t bitmapLen = 0;
+   unsigned int numPkts = 0;
+   unsigned int numAllowed = 0;
+
+   PcapPacket pkt;
+   while(success && NextPcapPacket(reader, &pkt))
+   {
+      if(numPkts / 8 >= bitmapLen)
+      {
+         size_t len = bitmapLen > 0 ? bitmapLen * 2 : 4096;
+         unsigned char* pTemp = realloc(bitmap, len);
+         if(pTemp == NULL)
+         {
+            printf("ERROR, out of memory replaying %s\n", opts->inFile);
+            success = false;
+            break;
+         }
+         memset(pTemp + bitmapLen, 0, len - bitmapLen);
+         bitmap = pTemp;
+         bitmapLen = len;
+      }
+
+      if(FilterPacket(filter, pkt.data))
+      {
+         bitmap[numPkts / 8] |= (unsigned char)(1 << (numPkts % 8));
+         numAllowed++;
+
+         if(pFile != NULL)
+         {
+            int length = (int)pkt.length;
+            fwrite(&length, sizeof(int), 1, pFile);
+            fwrite(pkt.data, 1, pkt.length, pFile);
+            if(indexWriter != NULL && !WritePktIndexFrame(indexWriter, pkt.length))
+               success = false;
+         }
+      }
+
+      numPkts++;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &filtered);
+
+   if(PcapReaderFailed(reader))
+      printf("WARNING, %s is malformed or truncated, replayed the packets before it\n", opts->inFile);
+   if(PcapSkippedFrames(reader) > 0)
+      printf("Skipped %llu frames that were not IPv4\n", PcapSkippedFrames(reader));
+
+   if(pFile != NULL)
+   {
+      int count = (int)numAllowed;
+      if(fseek(pFile, 0, SEEK_SET) != 0 || fwrite(&count, sizeof(int), 1, pFile) != 1)
+         success = false;
+      if(ferror(pFile)) success = false;
+      if(fclose(pFile) != 0) success = false;
+      if(indexWriter != NULL && !ClosePktIndexWriter(indexWriter)) success = false;
+      if(!success) printf("ERROR, failed writing %s\n", opts->outFile);
+   }
+
+   if(success && opts->bitmapFile != NULL)
+      success = WriteBitmap(opts->bitmapFile, bitmap, numPkts);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   PrintSummary(numPkts, numAllowed, 1, &start, &filtered, &end);
+
+   free(bitmap);
+   ClosePcapReader(reader);
+   return success;
+}
+
+
+/// Prints the number of packets replayed, and the time taken to filter
+/// them and to finish writing the outputs
+/// @param numPkts Number of packets filtered
+/// @param numAllowed Number of packets allowed
+/// @param numThreads Number of filtering threads
+/// @param start When the replay started
+/// @param filtered When filtering finished
+/// @param end When the outputs were written
+static void PrintSummary(unsigned int numPkts, unsigned int numAllowed, unsigned int numThreads,
+                         struct timespec* start, struct timespec* filtered, struct timespec* end)
+{
+   double filterTime = ElapsedSeconds(start, filtered);
+   double totalTime = ElapsedSeconds(start, end);
+   printf("Replayed %u packets (%u allowed, %u blocked) using %u threads\n",
+          numPkts, numAllowed, numPkts - numAllowed, numThreads);
+   printf("Filter time: %.3f s (%.0f packets/sec)\n",
+          filterTime, filterTime > 0 ? numPkts / filterTime : 0.0);
+   printf("Total wall time: %.3f s (%.0f packets/sec)\n",
+          totalTime, totalTime > 0 ? numPkts / totalTime : 0.0);
+}
+
+
+/// Returns the seconds elapsed between two monotonic clock readings
+/// @param start The earlier reading
+/// @param end The later reading
+/// @return The difference in seconds
+static double ElapsedSeconds(struct timespec* start, struct timespec* end)
+{
+   return (double)(end->tv_sec - start->tv_sec) +
+          (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
@@ -0,0 +1,48 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+/// \file replay.h
+/// \brief Filters a capture file offline, without going through the
+/// ToFirewall/FromFirewall named pipes.
+///
+/// The capture file uses the same layout as the packets.N files that are
+/// fed to pktSender: an int holding the number of packets, followed by
+/// one [int length][length bytes] frame per packet. The file is mapped
+/// into memory and the frames are handed to FilterPacket() in place, by
+/// several threads at once. pcap and pcapng captures are also accepted;
+/// they are filtered on one thread and their link-layer headers are
+/// dropped from the output.
+///
+
+#include <stdbool.h>
+
+#include "filter.h"
+
+
+/// Settings for a single offline replay run
+typedef struct ReplayOptions_S
+{
+   /// The capture file that is to be filtered
+   char* inFile;
+
+   /// Where to write the allowed frames (packets.N format), or NULL
+   char* outFile;
+
+   /// Where to write the verdict bitmap, or NULL
+   char* bitmapFile;
+
+   /// Number of filtering threads, 0 selects one per online CPU
+   unsigned int numThreads;
+} ReplayOptions;
+
+
+/// Filters every packet of a capture file and writes the requested
+/// outputs. The verdict bitmap file holds an int packet count followed
+/// by one bit per packet (bit i%8 of byte i/8), set when the packet is
+/// allowed. A summary with the wall time and packets/sec is printed to
+/// stdout when finished.
+/// @param filter A configured filter instance
+/// @param opts The input/output files and thread count to use
+/// @return True if successful
+bool ReplayCapture(IpPktFilter filter, ReplayOptions* opts);
+
+#endif